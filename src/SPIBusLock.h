@@ -0,0 +1,248 @@
+#pragma once
+#include <inttypes.h>
+
+/*
+	Блокировка шины SPI на время одной транзакции (от DeviceActivate() до DeviceDeactivate()).
+	
+	По умолчанию (без RTOS) это флаг, защищённый запретом прерываний. Основной цикл захватывает его всегда,
+	а прерывание, застав шину занятой, должно отложить работу через SPIManager::Request().
+	Макросы SPI_CRITICAL_ENTER / SPI_CRITICAL_EXIT / SPI_IN_INTERRUPT можно переопределить под свою платформу.
+	
+	Шину захватывает владелец (устройство или менеджер на время пакета), и освободить её может только он:
+	Unlock() чужим владельцем ничего не делает. Так устройство, не сумевшее захватить шину, не снимет
+	чужую транзакцию, пакет или сессию своим DeviceDeactivate().
+	
+	С флагом SPI_BUS_LOCK_FREERTOS используется мьютекс FreeRTOS с наследованием приоритета: задачи ждут
+	освобождения шины. Мьютекс нельзя брать из прерывания, поэтому прерывание захватывает шину флагом,
+	только если мьютекс свободен, и должно отпустить её до выхода (транзакция целиком внутри прерывания,
+	как SPI_HC595_BAM::Refresh()). Задача, получившая мьютекс при таком флаге, шину не получает.
+	Застав шину занятой, прерывание откладывает работу через SPIManager::Request().
+	Задача, которая уже держит шину и захватывает её снова (другим устройством), получает отказ сразу, а не ждёт себя.
+	Нужны INCLUDE_xSemaphoreGetMutexHolder и INCLUDE_xTaskGetCurrentTaskHandle.
+	Мьютекс создаётся сразу в конструкторе (статически при configSUPPORT_STATIC_ALLOCATION), а не при первом
+	захвате: иначе две задачи, впервые захватывающие шину одновременно, создали бы по своему мьютексу.
+	Ready() == false - мьютекс не создан (не хватило кучи), шина не захватывается, Init() повторяет попытку.
+*/
+
+#if defined(SPI_BUS_LOCK_FREERTOS)
+	#include "FreeRTOS.h"
+	#include "semphr.h"
+#endif
+
+#if !defined(SPI_CRITICAL_ENTER)
+	#define SPI_CRITICAL_ENTER(state)	asm volatile("mrs %0, primask\n cpsid i" : "=r"(state) :: "memory")
+	#define SPI_CRITICAL_EXIT(state)	asm volatile("msr primask, %0" :: "r"(state) : "memory")
+#endif
+
+#if !defined(SPI_IN_INTERRUPT)
+	// Номер активного исключения (IPSR), 0 - основной поток.
+	#define SPI_IN_INTERRUPT(result)	asm volatile("mrs %0, ipsr" : "=r"(result))
+#endif
+
+class SPIBusLock
+{
+	public:
+		
+#if defined(SPI_BUS_LOCK_FREERTOS)
+		
+		SPIBusLock() : _mutex(nullptr)
+		{
+			Init();
+		}
+		
+		/// @brief Создать мьютекс, если он ещё не создан. Вызывается конструктором, повторно - только до захватов шины.
+		/// @return false если мьютекс создать не удалось
+		bool Init()
+		{
+			if(_mutex != nullptr) return true;
+
+#if (configSUPPORT_STATIC_ALLOCATION == 1)
+			_mutex = xSemaphoreCreateMutexStatic(&_mutex_buffer);
+#else
+			_mutex = xSemaphoreCreateMutex();
+#endif
+			
+			return (_mutex != nullptr);
+		}
+		
+		bool Ready() const
+		{
+			return (_mutex != nullptr);
+		}
+		
+		/// @brief Захватить шину, ожидая её освобождения. Из прерывания не ждёт, см. описание.
+		/// @param owner Владелец, только он освободит шину
+		bool Lock(const void *owner)
+		{
+			return _Take(owner, portMAX_DELAY);
+		}
+		
+		/// @brief Захватить шину, если она свободна
+		bool TryLock(const void *owner)
+		{
+			return _Take(owner, 0);
+		}
+		
+		/// @brief Освободить шину
+		/// @return false если шину держит не owner, она при этом не освобождается
+		bool Unlock(const void *owner)
+		{
+			if(_mutex == nullptr || _owner != owner) return false;
+			
+			_owner = nullptr;
+			if(_isr_owned == true)
+			{
+				_isr_owned = false;
+				
+				return true;
+			}
+			xSemaphoreGive(_mutex);
+			
+			return true;
+		}
+		
+		bool IsLocked()
+		{
+			return (_mutex != nullptr && (_isr_owned == true || xSemaphoreGetMutexHolder(_mutex) != nullptr));
+		}
+		
+		static bool InInterrupt()
+		{
+			return xPortIsInsideInterrupt() == pdTRUE;
+		}
+		
+		static uint32_t CriticalEnter()
+		{
+			return portSET_INTERRUPT_MASK_FROM_ISR();
+		}
+		
+		static void CriticalExit(uint32_t state)
+		{
+			portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+			
+			return;
+		}
+		
+	private:
+		
+		bool _Take(const void *owner, TickType_t wait)
+		{
+			if(_mutex == nullptr) return false;
+			
+			if(InInterrupt() == true)
+			{
+				// Задачи стоят, пока прерывание не выйдет: свободный мьютекс никто не возьмёт до Unlock().
+				UBaseType_t state = taskENTER_CRITICAL_FROM_ISR();
+				bool result = (_owner == nullptr && xSemaphoreGetMutexHolderFromISR(_mutex) == nullptr);
+				if(result == true)
+				{
+					_owner = owner;
+					_isr_owned = true;
+				}
+				taskEXIT_CRITICAL_FROM_ISR(state);
+				
+				return result;
+			}
+			
+			// Мьютекс не рекурсивный: задача, уже держащая шину (поток NORReader, сессия чтения) и обратившаяся
+			// к другому устройству, ждала бы саму себя вечно. Отказываем сразу, как при занятой шине.
+			if(xSemaphoreGetMutexHolder(_mutex) == xTaskGetCurrentTaskHandle()) return false;
+			
+			if(xSemaphoreTake(_mutex, wait) != pdTRUE) return false;
+			if(_isr_owned == true)
+			{
+				// Прерывание не отпустило шину до выхода - ошибка его кода, но шину не отдаём.
+				xSemaphoreGive(_mutex);
+				
+				return false;
+			}
+			_owner = owner;
+			
+			return true;
+		}
+		
+		SemaphoreHandle_t _mutex;
+#if (configSUPPORT_STATIC_ALLOCATION == 1)
+		StaticSemaphore_t _mutex_buffer;
+#endif
+		const void *volatile _owner = nullptr;
+		volatile bool _isr_owned = false;
+		
+#else
+		
+		bool Init()
+		{
+			return true;
+		}
+		
+		bool Ready() const
+		{
+			return true;
+		}
+		
+		/// @brief Захватить шину. Без RTOS ждать некого: занятой её может застать только прерывание.
+		/// @param owner Владелец, только он освободит шину
+		bool Lock(const void *owner)
+		{
+			return TryLock(owner);
+		}
+		
+		/// @brief Захватить шину, если она свободна
+		bool TryLock(const void *owner)
+		{
+			uint32_t state;
+			SPI_CRITICAL_ENTER(state);
+			bool result = (_owner == nullptr);
+			if(result == true) _owner = owner;
+			SPI_CRITICAL_EXIT(state);
+			
+			return result;
+		}
+		
+		/// @brief Освободить шину
+		/// @return false если шину держит не owner, она при этом не освобождается
+		bool Unlock(const void *owner)
+		{
+			uint32_t state;
+			SPI_CRITICAL_ENTER(state);
+			bool result = (_owner == owner);
+			if(result == true) _owner = nullptr;
+			SPI_CRITICAL_EXIT(state);
+			
+			return result;
+		}
+		
+		bool IsLocked()
+		{
+			return (_owner != nullptr);
+		}
+		
+		static bool InInterrupt()
+		{
+			uint32_t ipsr;
+			SPI_IN_INTERRUPT(ipsr);
+			
+			return (ipsr != 0);
+		}
+		
+		static uint32_t CriticalEnter()
+		{
+			uint32_t state;
+			SPI_CRITICAL_ENTER(state);
+			
+			return state;
+		}
+		
+		static void CriticalExit(uint32_t state)
+		{
+			SPI_CRITICAL_EXIT(state);
+			
+			return;
+		}
+		
+	private:
+		
+		const void *volatile _owner = nullptr;
+		
+#endif
+};
@@ -6,6 +6,15 @@
 class SPIDeviceInterface
 {
 	public:
+		
+		// Результат проверки связи известным ответом.
+		enum probe_t : uint8_t
+		{
+			PROBE_NONE,					// Устройство проверки не поддерживает
+			PROBE_OK,					// Ответ совпал
+			PROBE_FAIL,					// Ответ не совпал
+		};
+		
 		SPIDeviceInterface(const DrakePin::PinD_t &spi_cs_pin, uint32_t spi_prescaler) : 
 			_spi_config{spi_prescaler, 0}, 
 			_spi_cs_pin(spi_cs_pin, DrakePin::Output, DrakePin::High)
@@ -14,6 +23,13 @@ class SPIDeviceInterface
 		virtual void Init() = 0;
 		virtual void Tick(uint32_t &time) = 0;
 		
+		/// @brief Проверить связь известным ответом, для подбора частоты шины.
+		/// Эталон устройство снимает в Init() на заданной при создании частоте.
+		virtual probe_t DeviceProbe()
+		{
+			return PROBE_NONE;
+		}
+		
 		void PrepareInit(SPIManagerInterface *spi)
 		{
 			_spi_interface = spi;
@@ -22,17 +38,101 @@ class SPIDeviceInterface
 			return;
 		}
 		
-		void DeviceActivate()
+		/*
+			Функции работы с шиной принимают тип менеджера _manager_t. По умолчанию это SPIManagerInterface
+			и вызовы виртуальные. Драйвер, параметризованный типом final-менеджера (SPIStaticManager), передаёт
+			его сюда, и вызовы через указатель на этот тип девиртуализируются и встраиваются вместе с бэкендом.
+			Устройство должно быть добавлено именно в менеджер этого типа.
+		*/
+		
+		/// @brief Менеджер, в который добавлено устройство, как _manager_t
+		template<typename _manager_t = SPIManagerInterface> 
+		_manager_t *DeviceManager() const
 		{
-			_spi_interface->Config(_spi_config);
+			return static_cast<_manager_t *>(_spi_interface);
+		}
+		
+		/// @brief Захватить шину и выставить CS
+		/// @return false если шина занята другим контекстом, CS при этом не выставляется.
+		/// Тогда и DeviceDeactivate() вызывать нельзя: транзакции не было.
+		template<typename _manager_t = SPIManagerInterface> 
+		bool DeviceActivate()
+		{
+			if(DeviceAcquire<_manager_t>() == false) return false;
+			
 			_spi_cs_pin.Off();
 
+			return true;
+		}
+		
+		/// @brief Захватить шину и настроить её под устройство, не выставляя CS. Для серии транзакций
+		/// с CS через DeviceSelect() / DeviceDeselect() без повторного захвата и настройки.
+		/// @return false если шина занята другим контекстом
+		template<typename _manager_t = SPIManagerInterface> 
+		bool DeviceAcquire()
+		{
+			_manager_t *spi = DeviceManager<_manager_t>();
+			if(spi->Lock(this) == false) return false;
+			
+			spi->Config(_spi_config);
+			
+			return true;
+		}
+		
+		/// @brief Освободить шину после DeviceAcquire()
+		template<typename _manager_t = SPIManagerInterface> 
+		void DeviceRelease()
+		{
+			DeviceManager<_manager_t>()->Unlock(this);
+			
 			return;
 		}
 		
+		/// @brief Снять CS и освободить шину. Это точка, в которой выполняются отложенные запросы
+		template<typename _manager_t = SPIManagerInterface> 
 		void DeviceDeactivate()
 		{
 			_spi_cs_pin.On();
+			DeviceManager<_manager_t>()->Unlock(this);
+			
+			return;
+		}
+		
+		/// @brief Выполнить список участков одной транзакцией: захват шины, CS, участки, снятие CS
+		/// @return false если шина занята другим контекстом
+		template<typename _manager_t = SPIManagerInterface, uint8_t N> 
+		bool DeviceTransfer(const SPIManagerInterface::segment_t (&segments)[N])
+		{
+			if(DeviceActivate<_manager_t>() == false) return false;
+			DeviceManager<_manager_t>()->Transfer(segments, N);
+			DeviceDeactivate<_manager_t>();
+			
+			return true;
+		}
+		
+		/// @brief Выставить CS без захвата шины и настройки. Для менеджера при выполнении пакета.
+		void DeviceSelect()
+		{
+			_spi_cs_pin.Off();
+			
+			return;
+		}
+		
+		void DeviceDeselect()
+		{
+			_spi_cs_pin.On();
+			
+			return;
+		}
+		
+		const SPIManagerInterface::spi_config_t &DeviceConfig() const
+		{
+			return _spi_config;
+		}
+		
+		void DevicePrescaler(uint32_t prescaler)
+		{
+			_spi_config.prescaler = prescaler;
 			
 			return;
 		}
@@ -1,78 +1,603 @@
 #pragma once
 #include <inttypes.h>
+#include <string.h>
 #include "SPIManagerInterface.h"
 #include "SPIDeviceInterface.h"
+#include "SPIBusLock.h"
+#include "SPITrace.h"
 
+/*
+	Устройства вызываются в Tick() по приоритету (0 - наивысший), каждое не чаще своего периода.
+	Если задан бюджет времени на Tick(), устройства с приоритетом выше 0 после его исчерпания
+	откладываются до следующего вызова. Устройства с приоритетом 0 вызываются всегда.
+	Старения приоритетов нет: если бюджет раз за разом уходит на более приоритетные устройства, устройство
+	с низким приоритетом не вызывается вовсе. Это видно по росту deferred в GetStats(), лечится бюджетом или приоритетом.
+	
+	Шина захватывается на время каждой транзакции (см. SPIBusLock). Работа из прерываний передаётся
+	через Request(): если шина свободна, запрос выполняется сразу, иначе - при освобождении шины
+	текущей транзакцией, не дожидаясь конца многотранзакционной операции прерванного кода.
+	
+	Подбор частоты (SetCalibration()): в AddDevice() после Init() устройство с проверкой связи (DeviceProbe())
+	переводится на всё более быстрые делители из таблицы, пока проверка не начнёт ошибаться, после чего
+	остаётся на самой быстрой надёжной ступени, отступив на заданный запас. Без проверки или если исходного
+	делителя нет в таблице, делитель не меняется.
+	
+	Пакет (BatchAdd() / BatchRun()) - транзакции нескольких устройств, выполняемые подряд одним захватом шины,
+	например цикл ввода-вывода HC165 + HC595 + опрос MCP2515. Наследник может передать весь пакет
+	в аппаратную цепочку (DMA по участкам, CS через запись GPIO из DMA или свою функцию) и сообщить о её
+	завершении вызовом BatchComplete() из единственного прерывания. Без этого пакет выполняется процессором.
+	Действия вне шины (импульс SH/LD у HC165, защёлка RCLK у HC595) задаются транзакции функциями before / after.
+	Пока пакет выполняется, шина занята, а Tick() устройств откладывается до его завершения.
+	
+	Журнал (SetTrace()) записывает каждую операцию шины с номером устройства в порядке добавления, см. SPITrace.
+*/
+
+// Менеджер одной шины, как его видит SPIMultiManager.
+class SPIBusManagerInterface : public SPIManagerInterface
+{
+	public:
+		
+		// Статистика вызовов устройства.
+		struct device_stats_t
+		{
+			uint32_t runs;				// Кол-во вызовов Tick() устройства
+			uint32_t deferred;			// Кол-во откладываний из-за исчерпания бюджета или выполняющегося пакета
+			uint32_t missed;			// Кол-во вызовов, опоздавших больше чем на период
+		};
+		
+		virtual void AddDevice(SPIDeviceInterface &device, uint8_t priority = 0, uint16_t period = 0) = 0;
+		virtual void Tick(uint32_t &time) = 0;
+		virtual const device_stats_t *GetStats(const SPIDeviceInterface &device) const = 0;
+		
+		/// @brief Суммарная статистика всех устройств шины
+		/// @param count Кол-во устройств на шине
+		virtual device_stats_t GetTotalStats(uint8_t &count) const = 0;
+};
+
+// Общая часть менеджеров: устройства, планирование Tick(), блокировка шины. Передачу реализуют наследники.
 template <uint8_t _device_max> 
-class SPIManager : public SPIManagerInterface
+class SPIManagerBase : public SPIBusManagerInterface
 {
-	using callback_config_t = void (*)(const spi_config_t &config);
-	using callback_tx_t = void (*)(uint8_t *data, uint16_t length);
-	using callback_rx_t = void (*)(uint8_t *data, uint16_t length);
-	using callback_txrx_t = void (*)(uint8_t *tx_data, uint8_t *rx_data, uint16_t length);
+	using callback_clock_t = uint32_t (*)();
+	using callback_job_t = void (*)();
+	
+	static constexpr uint8_t REQUEST_MAX = 4;
+	static constexpr uint8_t BATCH_MAX = 8;
 	
 	public:
-		SPIManager(callback_config_t cfg, callback_tx_t tx, callback_rx_t rx, callback_txrx_t txrx) : _callback_config(cfg), _callback_tx(tx), _callback_rx(rx), _callback_txrx(txrx)
+		
+		SPIManagerBase()
 		{
 			memset(devices, 0x00, sizeof(devices));
 		}
 		
-		void AddDevice(SPIDeviceInterface &device)
+		/// @brief Добавить устройство
+		/// @param device Устройство
+		/// @param priority Приоритет, 0 - наивысший, такие устройства не откладываются
+		/// @param period Минимальный период вызова Tick() устройства, мс, 0 - каждый вызов
+		virtual void AddDevice(SPIDeviceInterface &device, uint8_t priority = 0, uint16_t period = 0) override
 		{
 			if(devices_count >= _device_max) return;
 			
-			devices[devices_count++] = &device;
+			// Вставка с сохранением порядка по приоритету, при равном приоритете - по порядку добавления.
+			uint8_t idx = devices_count;
+			while(idx > 0 && devices[idx - 1].priority > priority)
+			{
+				devices[idx] = devices[idx - 1];
+				--idx;
+			}
+			devices[idx] = {&device, devices_count, priority, period, 0, {0, 0, 0}};
+			devices_count++;
+			
 			device.PrepareInit(this);
 			device.Init();
 			
+			if(_cal_prescalers != nullptr) Calibrate(device);
+			
 			return;
 		}
 		
-		void Tick(uint32_t &time)
+		/// @brief Включить подбор частоты устройств в AddDevice()
+		/// @param prescalers Значения делителя бэкенда, от самого медленного к самому быстрому. Должны существовать всё время работы.
+		/// @param count Кол-во значений, 0 - отключить подбор
+		/// @param margin На сколько ступеней отступить от самой быстрой надёжной
+		/// @param attempts Кол-во проверок, которые должны пройти на ступени
+		void SetCalibration(const uint32_t *prescalers, uint8_t count, uint8_t margin = 1, uint8_t attempts = 8)
 		{
+			_cal_prescalers = (count > 0) ? prescalers : nullptr;
+			_cal_count = count;
+			_cal_margin = margin;
+			_cal_attempts = (attempts > 0) ? attempts : 1;
+			
+			return;
+		}
+		
+		/// @brief Подобрать делитель устройства по таблице из SetCalibration()
+		/// @param device Устройство, уже инициализированное на исходном делителе
+		/// @return Выбранный делитель
+		uint32_t Calibrate(SPIDeviceInterface &device)
+		{
+			uint32_t start = device.DeviceConfig().prescaler;
+			if(_cal_prescalers == nullptr) return start;
+			
+			uint8_t idx = 0;
+			while(idx < _cal_count && _cal_prescalers[idx] != start) ++idx;
+			if(idx == _cal_count) return start;
+			
+			// Если связи нет и на исходной частоте, ускорять нечего.
+			if(device.DeviceProbe() != SPIDeviceInterface::PROBE_OK) return start;
+			
+			uint8_t best = idx;
+			for(uint8_t step = idx + 1; step < _cal_count; ++step)
+			{
+				device.DevicePrescaler(_cal_prescalers[step]);
+				
+				uint8_t passed = 0;
+				while(passed < _cal_attempts && device.DeviceProbe() == SPIDeviceInterface::PROBE_OK) ++passed;
+				if(passed < _cal_attempts) break;
+				
+				best = step;
+			}
+			
+			best = (best - idx > _cal_margin) ? best - _cal_margin : idx;
+			device.DevicePrescaler(_cal_prescalers[best]);
+			
+			return _cal_prescalers[best];
+		}
+		
+		/// @brief Задать бюджет времени на один вызов Tick()
+		/// @param budget Бюджет в единицах clock, 0 - без ограничения
+		/// @param clock Функция, возвращающая текущее время (например, в мкс), nullptr - без ограничения
+		void SetBudget(uint32_t budget, callback_clock_t clock)
+		{
+			_budget = (clock != nullptr) ? budget : 0;
+			_clock = clock;
+			
+			return;
+		}
+		
+		/// @brief Выполнить работу с шиной из прерывания или другого контекста
+		/// @param job Функция, выполняющая транзакции через драйверы
+		/// @return false если очередь отложенных запросов переполнена
+		bool Request(callback_job_t job)
+		{
+			if(SPIBusLock::InInterrupt() == false && _lock.IsLocked() == false)
+			{
+				job();
+				
+				return true;
+			}
+			
+			uint32_t state = SPIBusLock::CriticalEnter();
+			bool result = (_requests_count < REQUEST_MAX);
+			if(result == true)
+			{
+				_requests[(_requests_head + _requests_count) % REQUEST_MAX] = job;
+				_requests_count++;
+			}
+			SPIBusLock::CriticalExit(state);
+			
+			return result;
+		}
+		
+		/// @brief Добавить транзакцию устройства в пакет
+		/// @param device Устройство
+		/// @param segments Участки транзакции, должны оставаться в памяти до завершения пакета
+		/// @param count Кол-во участков
+		/// @param before Вызывается перед выбором устройства, nullptr - нет
+		/// @param after Вызывается после снятия выбора устройства, nullptr - нет
+		/// @return false если пакет заполнен или уже выполняется
+		bool BatchAdd(SPIDeviceInterface &device, const segment_t *segments, uint8_t count, batch_hook_t before = nullptr, batch_hook_t after = nullptr)
+		{
+			if(_batch_busy == true || _batch_count >= BATCH_MAX) return false;
+			
+			_batch[_batch_count++] = {&device, segments, count, before, after};
+			
+			return true;
+		}
+		
+		template<uint8_t N> 
+		bool BatchAdd(SPIDeviceInterface &device, const segment_t (&segments)[N], batch_hook_t before = nullptr, batch_hook_t after = nullptr)
+		{
+			return BatchAdd(device, segments, N, before, after);
+		}
+		
+		/// @brief Выполнить пакет
+		/// @param done Функция, вызываемая по завершении пакета (при аппаратной цепочке - из её прерывания)
+		/// @return false если пакет пуст, уже выполняется или шина занята
+		bool BatchRun(callback_job_t done = nullptr)
+		{
+			if(_batch_busy == true || _batch_count == 0) return false;
+			if(_lock.Lock(this) == false) return false;
+			
+			_batch_busy = true;
+			_batch_done = done;
+			_trace.Add(SPITrace::OP_BATCH, nullptr, _batch_count);
+			
+			if(_BatchStart(_batch, _batch_count) == true) return true;
+			
+			for(uint8_t i = 0; i < _batch_count; ++i)
+			{
+				const batch_item_t &item = _batch[i];
+				
+				this->Config(item.device->DeviceConfig());
+				if(item.before != nullptr) item.before(item.device);
+				item.device->DeviceSelect();
+				this->Transfer(item.segments, item.count);
+				item.device->DeviceDeselect();
+				if(item.after != nullptr) item.after(item.device);
+			}
+			BatchComplete();
+			_BatchRelease();
+			
+			return true;
+		}
+		
+		/// @brief Сообщить о завершении пакета. Вызывается наследником или из прерывания конца цепочки.
+		void BatchComplete()
+		{
+			if(_batch_busy == false) return;
+			
+			_batch_count = 0;
+			_batch_busy = false;
+			// Шину освобождаем не здесь, а в основном цикле: мьютекс RTOS нельзя отдать из прерывания.
+			_batch_release = true;
+			
+			if(_batch_done != nullptr) _batch_done();
+			
+			return;
+		}
+		
+		bool BatchBusy() const
+		{
+			return _batch_busy;
+		}
+		
+		/// @brief Блокировка шины создана (под FreeRTOS мьютекс мог не создаться из-за нехватки кучи)
+		bool BusReady() const
+		{
+			return _lock.Ready();
+		}
+		
+		/// @brief Начать запись журнала операций шины
+		/// @param buffer Буфер записей, должен существовать всё время записи
+		/// @param size Кол-во записей
+		/// @param clock Функция, возвращающая текущее время (например, счётчик мкс)
+		/// @param clock_hz Частота единиц времени clock
+		void SetTrace(SPITrace::record_t *buffer, uint16_t size, callback_clock_t clock, uint32_t clock_hz = 1000000)
+		{
+			_trace.Start(buffer, size, clock, clock_hz);
+			
+			return;
+		}
+		
+		/// @brief Журнал: Dump() для выдачи, Stop() для остановки
+		SPITrace &Trace()
+		{
+			return _trace;
+		}
+		
+		virtual void Tick(uint32_t &time) override
+		{
+			_BatchRelease();
+			
+			// Откладываются только устройства, которым подошёл срок.
+			if(_batch_busy == true)
+			{
+				for(uint8_t i = 0; i < devices_count; ++i)
+				{
+					device_slot_t &slot = devices[i];
+					if(slot.period > 0 && time - slot.last_run < slot.period) continue;
+					
+					slot.stats.deferred++;
+				}
+				
+				return;
+			}
+			
+			_RunRequests();
+			
+			uint32_t start = (_budget > 0) ? _clock() : 0;
+			
 			for(uint8_t i = 0; i < devices_count; ++i)
 			{
-				devices[i]->Tick(time);
+				device_slot_t &slot = devices[i];
+				
+				uint32_t elapsed = time - slot.last_run;
+				if(slot.period > 0 && elapsed < slot.period) continue;
+				
+				if(slot.priority > 0 && _budget > 0 && (_clock() - start) >= _budget)
+				{
+					slot.stats.deferred++;
+					
+					continue;
+				}
+				
+				if(slot.period > 0 && slot.stats.runs > 0 && elapsed >= (uint32_t)slot.period * 2)
+				{
+					slot.stats.missed++;
+				}
+				slot.last_run = time;
+				slot.stats.runs++;
+				
+				slot.device->Tick(time);
 			}
 			
 			return;
 		}
 		
+		/// @brief Статистика устройства
+		/// @param device Устройство
+		/// @return Указатель на статистику или nullptr, если устройство не добавлено
+		virtual const device_stats_t *GetStats(const SPIDeviceInterface &device) const override
+		{
+			for(uint8_t i = 0; i < devices_count; ++i)
+			{
+				if(devices[i].device == &device) return &devices[i].stats;
+			}
+			
+			return nullptr;
+		}
+		
+		virtual device_stats_t GetTotalStats(uint8_t &count) const override
+		{
+			device_stats_t result = {0, 0, 0};
+			for(uint8_t i = 0; i < devices_count; ++i)
+			{
+				result.runs += devices[i].stats.runs;
+				result.deferred += devices[i].stats.deferred;
+				result.missed += devices[i].stats.missed;
+			}
+			count = devices_count;
+			
+			return result;
+		}
+		
 		void DiselectAll()
 		{
-			for(SPIDeviceInterface &device : devices)
+			for(uint8_t i = 0; i < devices_count; ++i)
 			{
-				device.DeviceDeactivate();
+				devices[i].device->DeviceDeselect();
 			}
 			
 			return;
 		}
 		
+		virtual bool Lock(const void *owner) override
+		{
+			bool result = _lock.Lock(owner);
+			if(result == false) _trace.Add(SPITrace::OP_BUSY, nullptr, 0);
+			
+			return result;
+		}
+		
+		virtual void Unlock(const void *owner) override
+		{
+			if(_lock.Unlock(owner) == false) return;
+			
+			_trace.Add(SPITrace::OP_END, nullptr, 0);
+			_trace.Device(SPITrace::DEVICE_NONE);
+			
+			_RunRequests();
+			
+			return;
+		}
+		
+	protected:
+		
+		/// @brief Записать в журнал настройку шины. Config() вызывается из DeviceActivate() с настройками
+		/// самого устройства, поэтому устройство определяется по их адресу.
+		void _TraceConfig(const spi_config_t &config)
+		{
+			if(_trace.Enabled() == false) return;
+			
+			uint8_t device = SPITrace::DEVICE_NONE;
+			for(uint8_t i = 0; i < devices_count; ++i)
+			{
+				if(&devices[i].device->DeviceConfig() == &config) device = devices[i].id;
+			}
+			_trace.Device(device);
+			_trace.Add(SPITrace::OP_CONFIG, (const uint8_t *) &config, sizeof(config));
+			
+			return;
+		}
+		
+		void _Trace(SPITrace::op_t op, const uint8_t *data, uint16_t length)
+		{
+			_trace.Add(op, data, length);
+			
+			return;
+		}
+		
+		/// @brief Запустить пакет аппаратной цепочкой
+		/// Цепочка должна сама выполнить before / after транзакций или вернуть false, если не умеет.
+		/// @return true если цепочка запущена и по её окончании будет вызван BatchComplete(), false - выполнить процессором
+		virtual bool _BatchStart(const batch_item_t * /* items */, uint8_t /* count */)
+		{
+			return false;
+		}
+		
+	private:
+		
+		void _BatchRelease()
+		{
+			if(_batch_release == false) return;
+			
+			_batch_release = false;
+			Unlock(this);
+			
+			return;
+		}
+		
+		void _RunRequests()
+		{
+			// Запросы выполняются своими транзакциями, которые снова зовут Unlock(): не входим повторно.
+			if(_requests_running == true || _requests_count == 0) return;
+			if(SPIBusLock::InInterrupt() == true) return;
+			_requests_running = true;
+			
+			while(_requests_count > 0)
+			{
+				uint32_t state = SPIBusLock::CriticalEnter();
+				callback_job_t job = _requests[_requests_head];
+				_requests_head = (_requests_head + 1) % REQUEST_MAX;
+				_requests_count--;
+				SPIBusLock::CriticalExit(state);
+				
+				job();
+			}
+			
+			_requests_running = false;
+			
+			return;
+		}
+		
+		struct device_slot_t
+		{
+			SPIDeviceInterface *device;
+			uint8_t id;
+			uint8_t priority;
+			uint16_t period;
+			uint32_t last_run;
+			device_stats_t stats;
+		};
+		
+		device_slot_t devices[_device_max];
+		uint8_t devices_count = 0;
+		
+		SPIBusLock _lock;
+		SPITrace _trace;
+		callback_job_t _requests[REQUEST_MAX];
+		volatile uint8_t _requests_head = 0;
+		volatile uint8_t _requests_count = 0;
+		bool _requests_running = false;
+		
+		batch_item_t _batch[BATCH_MAX];
+		uint8_t _batch_count = 0;
+		volatile bool _batch_busy = false;
+		volatile bool _batch_release = false;
+		callback_job_t _batch_done = nullptr;
+		
+		uint32_t _budget = 0;
+		callback_clock_t _clock = nullptr;
+		
+		const uint32_t *_cal_prescalers = nullptr;
+		uint8_t _cal_count = 0;
+		uint8_t _cal_margin = 1;
+		uint8_t _cal_attempts = 8;
+};
+
+// Менеджер с передачей через функции, заданные при создании.
+template <uint8_t _device_max> 
+class SPIManager : public SPIManagerBase<_device_max>
+{
+	using spi_config_t = SPIManagerInterface::spi_config_t;
+	using callback_config_t = void (*)(const spi_config_t &config);
+	using callback_tx_t = void (*)(uint8_t *data, uint16_t length);
+	using callback_rx_t = void (*)(uint8_t *data, uint16_t length);
+	using callback_txrx_t = void (*)(uint8_t *tx_data, uint8_t *rx_data, uint16_t length);
+	using callback_transfer_t = void (*)(const SPIManagerInterface::segment_t *segments, uint8_t count);
+	using callback_batch_t = bool (*)(const SPIManagerInterface::batch_item_t *items, uint8_t count);
+	
+	public:
+		
+		SPIManager(callback_config_t cfg, callback_tx_t tx, callback_rx_t rx, callback_txrx_t txrx) : _callback_config(cfg), _callback_tx(tx), _callback_rx(rx), _callback_txrx(txrx)
+		{}
+		
 		virtual void Config(const spi_config_t &config) override
 		{
+			this->_TraceConfig(config);
 			_callback_config(config);
 		}
 		
 		virtual void TransmitData(uint8_t *data, uint16_t length) override
 		{
 			_callback_tx(data, length);
+			this->_Trace(SPITrace::OP_TX, data, length);
 		}
 		
 		virtual void ReceiveData(uint8_t *data, uint16_t length) override
 		{
 			_callback_rx(data, length);
+			this->_Trace(SPITrace::OP_RX, data, length);
 		}
 		
 		virtual void TransmitReceive(uint8_t *tx_data, uint8_t *rx_data, uint16_t length) override
 		{
+			// Передаваемые данные пишем до обмена: буфер приёма может совпадать с буфером передачи.
+			this->_Trace(SPITrace::OP_TXRX_TX, tx_data, length);
 			_callback_txrx(tx_data, rx_data, length);
+			this->_Trace(SPITrace::OP_TXRX, rx_data, length);
 		}
 		
-	private:
+		/// @brief Задать функцию, выполняющую список участков целиком (например, одной цепочкой DMA)
+		/// @param transfer Функция, nullptr - участки выполняются по одному через tx/rx/txrx
+		void SetTransferCallback(callback_transfer_t transfer)
+		{
+			_callback_transfer = transfer;
+			
+			return;
+		}
 		
-		SPIDeviceInterface *devices[_device_max];
-		uint8_t devices_count = 0;
+		virtual void Transfer(const SPIManagerInterface::segment_t *segments, uint8_t count) override
+		{
+			if(_callback_transfer == nullptr) return SPIManagerInterface::Transfer(segments, count);
+			
+			_callback_transfer(segments, count);
+			
+			for(uint8_t i = 0; i < count; ++i)
+			{
+				const SPIManagerInterface::segment_t &segment = segments[i];
+				switch(segment.type)
+				{
+					case SPIManagerInterface::SEGMENT_TX:
+					{
+						this->_Trace(SPITrace::OP_TX, segment.tx, segment.length);
+						break;
+					}
+					case SPIManagerInterface::SEGMENT_RX:
+					{
+						this->_Trace(SPITrace::OP_RX, segment.rx, segment.length);
+						break;
+					}
+					case SPIManagerInterface::SEGMENT_TXRX:
+					{
+						this->_Trace(SPITrace::OP_TXRX_TX, segment.tx, segment.length);
+						this->_Trace(SPITrace::OP_TXRX, segment.rx, segment.length);
+						break;
+					}
+					case SPIManagerInterface::SEGMENT_DUMMY:
+					{
+						this->_Trace(SPITrace::OP_TX, nullptr, segment.length);
+						break;
+					}
+				}
+			}
+		}
+		
+		/// @brief Задать функцию, запускающую пакет одной аппаратной цепочкой
+		/// @param batch Функция: строит цепочку по транзакциям (CS и before / after - по устройству), возвращает true если запустила её.
+		/// По окончании цепочки её прерывание должно вызвать BatchComplete(). nullptr - пакет выполняется процессором.
+		void SetBatchCallback(callback_batch_t batch)
+		{
+			_callback_batch = batch;
+			
+			return;
+		}
+		
+	protected:
+		
+		virtual bool _BatchStart(const SPIManagerInterface::batch_item_t *items, uint8_t count) override
+		{
+			if(_callback_batch == nullptr) return false;
+			
+			return _callback_batch(items, count);
+		}
+		
+	private:
 		
+		callback_transfer_t _callback_transfer = nullptr;
+		callback_batch_t _callback_batch = nullptr;
 		callback_config_t _callback_config;
 		callback_tx_t _callback_tx;
 		callback_rx_t _callback_rx;
@@ -13,8 +13,100 @@ class SPIManagerInterface
 			uint32_t first_bit;
 		};
 		
+		enum segment_type_t : uint8_t
+		{
+			SEGMENT_TX,					// Только передача
+			SEGMENT_RX,					// Только приём
+			SEGMENT_TXRX,				// Полный дуплекс
+			SEGMENT_DUMMY,				// Холостые такты (передача 0xFF)
+		};
+		
+		// Участок транзакции. Список участков выполняется под одним выставлением CS.
+		struct segment_t
+		{
+			segment_type_t type;
+			uint8_t *tx;
+			uint8_t *rx;
+			uint32_t length;
+		};
+		
+		static inline segment_t Tx(uint8_t *data, uint32_t length) { return {SEGMENT_TX, data, nullptr, length}; }
+		static inline segment_t Rx(uint8_t *data, uint32_t length) { return {SEGMENT_RX, nullptr, data, length}; }
+		static inline segment_t TxRx(uint8_t *tx_data, uint8_t *rx_data, uint32_t length) { return {SEGMENT_TXRX, tx_data, rx_data, length}; }
+		static inline segment_t Dummy(uint32_t length) { return {SEGMENT_DUMMY, nullptr, nullptr, length}; }
+		
+		// Действие до выбора или после снятия выбора устройства в пакете: импульс защёлки и т.п.
+		using batch_hook_t = void (*)(SPIDeviceInterface *device);
+		
+		// Транзакция одного устройства в пакете (см. SPIManagerBase::BatchAdd()).
+		struct batch_item_t
+		{
+			SPIDeviceInterface *device;
+			const segment_t *segments;
+			uint8_t count;
+			batch_hook_t before;		// До DeviceSelect(), nullptr - нет
+			batch_hook_t after;			// После DeviceDeselect(), nullptr - нет
+		};
+		
 		virtual void Config(const spi_config_t &config) = 0;
 		virtual void TransmitData(uint8_t *data, uint16_t length) = 0;
 		virtual void ReceiveData(uint8_t *data, uint16_t length) = 0;
 		virtual void TransmitReceive(uint8_t *tx_data, uint8_t *rx_data, uint16_t length) = 0;
+		
+		/// @brief Выполнить список участков. Бэкенд с DMA может переопределить и выполнить его одной цепочкой дескрипторов
+		/// @param segments Участки
+		/// @param count Кол-во участков
+		virtual void Transfer(const segment_t *segments, uint8_t count)
+		{
+			for(uint8_t i = 0; i < count; ++i)
+			{
+				const segment_t &segment = segments[i];
+				
+				// Длина участка 32-битная, а у базовых функций 16-битная: делим на куски.
+				uint32_t offset = 0;
+				while(offset < segment.length)
+				{
+					uint32_t left = segment.length - offset;
+					uint16_t chunk = (left > 0xFFFF) ? 0xFFFF : left;
+					
+					switch(segment.type)
+					{
+						case SEGMENT_TX:
+						{
+							TransmitData(segment.tx + offset, chunk);
+							break;
+						}
+						case SEGMENT_RX:
+						{
+							ReceiveData(segment.rx + offset, chunk);
+							break;
+						}
+						case SEGMENT_TXRX:
+						{
+							TransmitReceive(segment.tx + offset, segment.rx + offset, chunk);
+							break;
+						}
+						case SEGMENT_DUMMY:
+						{
+							uint8_t dummy[8];
+							if(chunk > sizeof(dummy)) chunk = sizeof(dummy);
+							for(uint8_t &byte : dummy) byte = 0xFF;
+							TransmitData(dummy, chunk);
+							break;
+						}
+					}
+					offset += chunk;
+				}
+			}
+			
+			return;
+		}
+		
+		/// @brief Захватить шину
+		/// @param owner Владелец захвата (устройство), только он может освободить шину
+		/// @return false если шина занята
+		virtual bool Lock(const void *owner) = 0;
+		
+		/// @brief Освободить шину. Если её держит не owner, ничего не делает.
+		virtual void Unlock(const void *owner) = 0;
 };
@@ -0,0 +1,145 @@
+#pragma once
+#include <inttypes.h>
+#include "SPIManager.h"
+
+/*
+	Несколько шин SPI под одним фасадом: например SPI1 - flash, SPI2 - CAN и сдвиговые регистры.
+	
+	Каждая шина - отдельный менеджер (SPIManager, SPIStaticManager) со своей блокировкой, своим бэкендом
+	и своим планированием. Устройство добавляется на конкретную шину и работает только с ней, поэтому
+	длинное чтение flash на одной шине не держит блокировку другой.
+	
+	Tick() обходит шины по очереди. Без RTOS транзакции выполняются последовательно, и параллельность
+	даёт только асинхронный бэкенд (пакет шины, запущенный цепочкой DMA, идёт, пока работают остальные шины).
+	С RTOS каждую шину удобно вести из своей задачи через Tick(bus, time): тогда шины не ждут друг друга вовсе.
+*/
+
+template <uint8_t _bus_max> 
+class SPIMultiManager
+{
+	using device_stats_t = SPIBusManagerInterface::device_stats_t;
+	
+	public:
+		
+		// Статистика шины.
+		struct bus_stats_t
+		{
+			uint8_t devices;			// Кол-во устройств на шине
+			uint32_t ticks;				// Кол-во обходов шины
+			device_stats_t total;		// Сумма статистики устройств шины
+		};
+		
+		/// @brief Добавить шину
+		/// @param bus Менеджер шины
+		/// @return Номер шины или -1, если шин уже _bus_max
+		int8_t AddBus(SPIBusManagerInterface &bus)
+		{
+			if(_bus_count >= _bus_max) return -1;
+			
+			_buses[_bus_count] = &bus;
+			_ticks[_bus_count] = 0;
+			
+			return _bus_count++;
+		}
+		
+		/// @brief Добавить устройство на шину
+		/// @param bus Номер шины
+		/// @param device Устройство
+		/// @param priority Приоритет на шине, 0 - наивысший
+		/// @param period Минимальный период вызова Tick() устройства, мс, 0 - каждый вызов
+		/// @return false если шины с таким номером нет
+		bool AddDevice(uint8_t bus, SPIDeviceInterface &device, uint8_t priority = 0, uint16_t period = 0)
+		{
+			if(bus >= _bus_count) return false;
+			
+			_buses[bus]->AddDevice(device, priority, period);
+			
+			return true;
+		}
+		
+		/// @brief Обойти все шины
+		void Tick(uint32_t &time)
+		{
+			for(uint8_t i = 0; i < _bus_count; ++i)
+			{
+				Tick(i, time);
+			}
+			
+			return;
+		}
+		
+		/// @brief Обойти одну шину, например из задачи, отвечающей за эту шину
+		void Tick(uint8_t bus, uint32_t &time)
+		{
+			if(bus >= _bus_count) return;
+			
+			_ticks[bus]++;
+			_buses[bus]->Tick(time);
+			
+			return;
+		}
+		
+		/// @brief Шина, на которой работает устройство
+		/// @return Номер шины или -1, если устройство не добавлено
+		int8_t DeviceBus(const SPIDeviceInterface &device) const
+		{
+			for(uint8_t i = 0; i < _bus_count; ++i)
+			{
+				if(_buses[i]->GetStats(device) != nullptr) return i;
+			}
+			
+			return -1;
+		}
+		
+		SPIBusManagerInterface *GetBus(uint8_t bus)
+		{
+			return (bus < _bus_count) ? _buses[bus] : nullptr;
+		}
+		
+		const device_stats_t *GetStats(const SPIDeviceInterface &device) const
+		{
+			int8_t bus = DeviceBus(device);
+			
+			return (bus < 0) ? nullptr : _buses[bus]->GetStats(device);
+		}
+		
+		bus_stats_t GetBusStats(uint8_t bus) const
+		{
+			bus_stats_t result = {};
+			if(bus >= _bus_count) return result;
+			
+			result.ticks = _ticks[bus];
+			result.total = _buses[bus]->GetTotalStats(result.devices);
+			
+			return result;
+		}
+		
+		/// @brief Суммарная статистика всех шин
+		bus_stats_t GetStats() const
+		{
+			bus_stats_t result = {};
+			for(uint8_t i = 0; i < _bus_count; ++i)
+			{
+				bus_stats_t bus = GetBusStats(i);
+				
+				result.devices += bus.devices;
+				result.ticks += bus.ticks;
+				result.total.runs += bus.total.runs;
+				result.total.deferred += bus.total.deferred;
+				result.total.missed += bus.total.missed;
+			}
+			
+			return result;
+		}
+		
+		uint8_t GetBusCount() const
+		{
+			return _bus_count;
+		}
+		
+	private:
+		
+		SPIBusManagerInterface *_buses[_bus_max];
+		uint32_t _ticks[_bus_max];
+		uint8_t _bus_count = 0;
+};
@@ -0,0 +1,104 @@
+#pragma once
+#include <inttypes.h>
+#include "SPIManager.h"
+
+/*
+	Менеджер со статическим бэкендом передачи.
+	
+	_backend - тип со статическими функциями:
+		static void Config(const SPIManagerInterface::spi_config_t &config);
+		static void TransmitData(uint8_t *data, uint16_t length);
+		static void ReceiveData(uint8_t *data, uint16_t length);
+		static void TransmitReceive(uint8_t *tx_data, uint8_t *rx_data, uint16_t length);
+	
+	В отличие от SPIManager здесь нет вызова через указатель на функцию: передача встраивается прямо
+	в методы менеджера. Класс final, поэтому вызовы через указатель или ссылку на SPIStaticManager
+	девиртуализируются и встраиваются до записи в регистры.
+	
+	Драйверы по умолчанию хранят SPIManagerInterface * и зовут менеджер виртуально, даже если он этого типа.
+	Без виртуальных вызовов работают драйверы, параметризованные типом менеджера (SPI_HC595, SPI_HC595_BAM,
+	SPI_HC165: параметр шаблона _manager_t; SPI_MCP2515: макрос SPI_MCP2515_MANAGER),
+	см. DeviceActivate<_manager_t>() в SPIDeviceInterface.
+*/
+
+template <typename _backend, uint8_t _device_max> 
+class SPIStaticManager final : public SPIManagerBase<_device_max>
+{
+	using spi_config_t = SPIManagerInterface::spi_config_t;
+	
+	public:
+		
+		virtual void Config(const spi_config_t &config) override
+		{
+			this->_TraceConfig(config);
+			_backend::Config(config);
+		}
+		
+		virtual void TransmitData(uint8_t *data, uint16_t length) override
+		{
+			_backend::TransmitData(data, length);
+			this->_Trace(SPITrace::OP_TX, data, length);
+		}
+		
+		virtual void ReceiveData(uint8_t *data, uint16_t length) override
+		{
+			_backend::ReceiveData(data, length);
+			this->_Trace(SPITrace::OP_RX, data, length);
+		}
+		
+		virtual void TransmitReceive(uint8_t *tx_data, uint8_t *rx_data, uint16_t length) override
+		{
+			// Передаваемые данные пишем до обмена: буфер приёма может совпадать с буфером передачи.
+			this->_Trace(SPITrace::OP_TXRX_TX, tx_data, length);
+			_backend::TransmitReceive(tx_data, rx_data, length);
+			this->_Trace(SPITrace::OP_TXRX, rx_data, length);
+		}
+		
+		/// @brief То же, что SPIManagerInterface::Transfer(), но участки уходят в _backend напрямую,
+		/// без виртуальных TransmitData() / ReceiveData() на каждый кусок.
+		virtual void Transfer(const SPIManagerInterface::segment_t *segments, uint8_t count) override
+		{
+			for(uint8_t i = 0; i < count; ++i)
+			{
+				const SPIManagerInterface::segment_t &segment = segments[i];
+				
+				// Длина участка 32-битная, а у бэкенда 16-битная: делим на куски.
+				uint32_t offset = 0;
+				while(offset < segment.length)
+				{
+					uint32_t left = segment.length - offset;
+					uint16_t chunk = (left > 0xFFFF) ? 0xFFFF : left;
+					
+					switch(segment.type)
+					{
+						case SPIManagerInterface::SEGMENT_TX:
+						{
+							SPIStaticManager::TransmitData(segment.tx + offset, chunk);
+							break;
+						}
+						case SPIManagerInterface::SEGMENT_RX:
+						{
+							SPIStaticManager::ReceiveData(segment.rx + offset, chunk);
+							break;
+						}
+						case SPIManagerInterface::SEGMENT_TXRX:
+						{
+							SPIStaticManager::TransmitReceive(segment.tx + offset, segment.rx + offset, chunk);
+							break;
+						}
+						case SPIManagerInterface::SEGMENT_DUMMY:
+						{
+							uint8_t dummy[8];
+							if(chunk > sizeof(dummy)) chunk = sizeof(dummy);
+							for(uint8_t &byte : dummy) byte = 0xFF;
+							SPIStaticManager::TransmitData(dummy, chunk);
+							break;
+						}
+					}
+					offset += chunk;
+				}
+			}
+			
+			return;
+		}
+};
@@ -0,0 +1,158 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include "SPIBusLock.h"
+
+/*
+	Кольцевой журнал операций шины SPI.
+	
+	Каждая запись - 16 байт: время окончания операции, номер устройства (порядок добавления в менеджер),
+	тип операции, длина и первые 8 байт данных (для CONFIG - делитель и порядок бит). Когда журнал заполнен,
+	старые записи затираются. Выключенный журнал стоит одной проверки указателя на операцию.
+	
+	Dump() выдаёт заголовок header_t и записи от старых к новым в виде как есть (little-endian),
+	этот формат читает tools/spi_trace.py.
+*/
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "SPITrace dump format is little-endian");
+
+class SPITrace
+{
+	public:
+		
+		using callback_clock_t = uint32_t (*)();
+		using callback_write_t = void (*)(const uint8_t *data, uint16_t length);
+		
+		static constexpr uint8_t VERSION = 1;
+		static constexpr uint8_t DEVICE_NONE = 0xFF;
+		
+		enum op_t : uint8_t
+		{
+			OP_CONFIG = 1,				// Настройка шины в начале транзакции
+			OP_TX,						// Передача
+			OP_RX,						// Приём
+			OP_TXRX,					// Полный дуплекс, данные - принятые
+			OP_END,						// Конец транзакции (снятие CS и освобождение шины)
+			OP_BUSY,					// Шина была занята, транзакция не выполнена
+			OP_BATCH,					// Запуск пакета, длина - кол-во транзакций
+			OP_TXRX_TX,					// Переданные данные полного дуплекса, следует перед своей OP_TXRX
+		};
+		
+		struct record_t
+		{
+			uint32_t time;
+			uint8_t device;
+			op_t op;
+			uint16_t length;
+			uint8_t data[8];
+		};
+		static_assert(sizeof(record_t) == 16, "SPITrace record must be 16 bytes");
+		
+		struct header_t
+		{
+			uint8_t magic[4];			// "SPTR"
+			uint8_t version;
+			uint8_t record_size;
+			uint16_t count;				// Кол-во записей в дампе
+			uint32_t total;				// Всего записей с начала записи, разница с count - затёртые
+			uint32_t clock_hz;			// Частота единиц времени
+		};
+		static_assert(sizeof(header_t) == 16, "SPITrace header must be 16 bytes");
+		
+		/// @brief Начать запись
+		/// @param buffer Буфер записей, должен существовать всё время записи
+		/// @param size Кол-во записей в буфере
+		/// @param clock Функция, возвращающая текущее время
+		/// @param clock_hz Частота единиц времени clock, для перевода в секунды при разборе
+		void Start(record_t *buffer, uint16_t size, callback_clock_t clock, uint32_t clock_hz = 1000000)
+		{
+			_buffer = nullptr;
+			_size = size;
+			_clock = clock;
+			_clock_hz = clock_hz;
+			_head = 0;
+			_total = 0;
+			_device = DEVICE_NONE;
+			_buffer = (size > 0 && clock != nullptr) ? buffer : nullptr;
+			
+			return;
+		}
+		
+		void Stop()
+		{
+			_buffer = nullptr;
+			
+			return;
+		}
+		
+		bool Enabled() const
+		{
+			return _buffer != nullptr;
+		}
+		
+		/// @brief Задать устройство, к которому относятся следующие записи
+		void Device(uint8_t device)
+		{
+			_device = device;
+			
+			return;
+		}
+		
+		void Add(op_t op, const uint8_t *data, uint16_t length)
+		{
+			if(_buffer == nullptr) return;
+			
+			uint32_t state = SPIBusLock::CriticalEnter();
+			record_t &record = _buffer[_head];
+			_head = (_head + 1 == _size) ? 0 : _head + 1;
+			_total++;
+			SPIBusLock::CriticalExit(state);
+			
+			record.time = _clock();
+			record.device = _device;
+			record.op = op;
+			record.length = length;
+			
+			uint8_t count = (data == nullptr) ? 0 : ((length < sizeof(record.data)) ? length : sizeof(record.data));
+			memcpy(record.data, data, count);
+			memset(record.data + count, 0x00, sizeof(record.data) - count);
+			
+			return;
+		}
+		
+		/// @brief Выдать журнал. На время выдачи запись приостанавливается.
+		/// @param write Функция вывода (UART, файл и т.п.)
+		/// @return Кол-во выданных записей
+		uint16_t Dump(callback_write_t write)
+		{
+			record_t *buffer = _buffer;
+			if(buffer == nullptr) return 0;
+			_buffer = nullptr;
+			
+			uint16_t count = (_total < _size) ? _total : _size;
+			uint16_t idx = (_total < _size) ? 0 : _head;
+			
+			header_t header = {{'S', 'P', 'T', 'R'}, VERSION, sizeof(record_t), count, _total, _clock_hz};
+			write((const uint8_t *) &header, sizeof(header));
+			
+			for(uint16_t i = 0; i < count; ++i)
+			{
+				write((const uint8_t *) &buffer[idx], sizeof(record_t));
+				idx = (idx + 1 == _size) ? 0 : idx + 1;
+			}
+			
+			_buffer = buffer;
+			
+			return count;
+		}
+	
+	private:
+		
+		record_t * volatile _buffer = nullptr;
+		uint16_t _size = 0;
+		uint16_t _head = 0;
+		uint32_t _total = 0;
+		uint8_t _device = DEVICE_NONE;
+		callback_clock_t _clock = nullptr;
+		uint32_t _clock_hz = 0;
+};
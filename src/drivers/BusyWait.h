@@ -0,0 +1,294 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+
+/*
+	Ожидание окончания записи / стирания памяти по времени.
+	
+	Драйвер вызывает Start() сразу после команды записи или стирания, а Wait() - перед следующим обращением.
+	Wait() выжидает половину типового времени операции, не трогая шину, один раз проверяет статус (чтобы
+	гистограмма видела и операции быстрее типовых), дожидается типового времени и дальше опрашивает статус
+	с удваивающимся интервалом. Если опрос не дождался готовности за два максимальных времени по документации - ошибка.
+	Длительности операций копятся в гистограмме по отношению к типовому времени, по ней времена можно уточнить.
+	
+	Источник времени общий для всех драйверов: один вызов BusyWait::SetDefaultClock() при старте. SetClock() задаёт
+	свой источник отдельному драйверу. Без источника времени работает как прежде: до LEGACY_POLLS опросов подряд.
+	Функция yield может отдать время другим задачам или устройствам: шина на время ожидания свободна.
+	
+	Wait() без начатой операции (после сброса, включения питания) ждёт готовности не дольше IDLE_TIMEOUT.
+	Poll() - ожидание заданным числом опросов подряд без учёта времени, как было до BusyWait.
+*/
+
+class BusyWait
+{
+	static constexpr uint32_t LEGACY_POLLS = 100000;
+	static constexpr uint32_t POLL_MIN = 10;					// мкс
+	static constexpr uint32_t POLL_MAX = 50000;					// мкс
+	static constexpr uint32_t TIMEOUT_FACTOR = 2;
+	static constexpr uint32_t IDLE_TIMEOUT = 10000;				// мкс
+	
+	public:
+		
+		using callback_clock_t = uint32_t (*)();
+		using callback_yield_t = void (*)(uint32_t us);
+		
+		static constexpr uint8_t HIST_BINS = 8;
+		
+		enum op_t : uint8_t
+		{
+			OP_PROGRAM,					// Запись страницы / байта
+			OP_ERASE_PAGE,
+			OP_ERASE_SECTOR,
+			OP_ERASE_BLOCK32,
+			OP_ERASE_BLOCK64,
+			OP_ERASE_CHIP,
+			OP_MAX,
+			OP_NONE = OP_MAX
+		};
+		
+		// Времена операции по документации, мкс.
+		struct timing_t
+		{
+			uint32_t typical;
+			uint32_t max;
+		};
+		
+		// Статистика операции. Корзина i гистограммы: длительность < typical * 2^(i-2), последняя - всё остальное.
+		struct stats_t
+		{
+			uint32_t count;
+			uint32_t timeouts;
+			uint32_t polls;				// Всего опросов статуса
+			uint32_t min;
+			uint32_t max;
+			uint32_t bins[HIST_BINS];
+		};
+		
+		BusyWait()
+		{
+			memset(_timings, 0x00, sizeof(_timings));
+			memset(_stats, 0x00, sizeof(_stats));
+		}
+		
+		/// @brief Задать общий источник времени для всех ожиданий без своего SetClock()
+		/// @param clock Функция, возвращающая время в мкс, nullptr - опрос без учёта времени
+		/// @param yield Функция ожидания заданного кол-ва мкс, может быть nullptr (ожидание по clock)
+		static void SetDefaultClock(callback_clock_t clock, callback_yield_t yield = nullptr)
+		{
+			_Default().clock = clock;
+			_Default().yield = yield;
+			
+			return;
+		}
+		
+		/// @brief Задать источник времени этого ожидания вместо общего
+		/// @param clock Функция, возвращающая время в мкс, nullptr - использовать общий
+		/// @param yield Функция ожидания заданного кол-ва мкс, может быть nullptr (ожидание по clock)
+		void SetClock(callback_clock_t clock, callback_yield_t yield = nullptr)
+		{
+			_clock = clock;
+			_yield = yield;
+			
+			return;
+		}
+		
+		/// @brief Задать времена операции
+		/// @param op Операция
+		/// @param typical Типовое время, мкс
+		/// @param max Максимальное время, мкс
+		void SetTiming(op_t op, uint32_t typical, uint32_t max)
+		{
+			if(op >= OP_MAX) return;
+			
+			_timings[op] = {typical, max};
+			
+			return;
+		}
+		
+		const timing_t &GetTiming(op_t op) const
+		{
+			return _timings[(op < OP_MAX) ? op : 0];
+		}
+		
+		const stats_t &Stats(op_t op) const
+		{
+			return _stats[(op < OP_MAX) ? op : 0];
+		}
+		
+		void ResetStats()
+		{
+			memset(_stats, 0x00, sizeof(_stats));
+			
+			return;
+		}
+		
+		/// @brief Отметить начало операции. Вызывается сразу после команды.
+		void Start(op_t op)
+		{
+			_op = op;
+			callback_clock_t clock = _Clock();
+			if(clock != nullptr) _start = clock();
+			
+			return;
+		}
+		
+		/// @brief Дождаться готовности
+		/// @param busy Функция опроса, возвращает true пока чип занят
+		/// @return false если чип не освободился за отведённое время
+		template<typename T>
+		bool Wait(T busy)
+		{
+			callback_clock_t clock = _Clock();
+			if(clock == nullptr) return Poll(busy, LEGACY_POLLS);
+			
+			op_t op = _op;
+			_op = OP_NONE;
+			
+			// Без начатой операции (например, после сброса) сразу опрашиваем с коротким пределом. Операция без
+			// заданных времён ждётся не дольше самой долгой из известных.
+			timing_t timing = {0, 0};
+			uint32_t timeout = IDLE_TIMEOUT;
+			bool known = (op < OP_MAX && _timings[op].max > 0);
+			if(known == true)
+			{
+				timing = _timings[op];
+				timeout = timing.max * TIMEOUT_FACTOR;
+			}
+			else
+			{
+				_start = clock();
+				if(op != OP_NONE)
+				{
+					for(const timing_t &item : _timings)
+					{
+						if(item.max > timing.max) timing.max = item.max;
+					}
+					timeout = timing.max * TIMEOUT_FACTOR;
+				}
+			}
+			
+			uint32_t elapsed = clock() - _start;
+			if(elapsed < timing.typical / 2) _Sleep(timing.typical / 2 - elapsed);
+			
+			uint32_t limit = _Clamp(timing.typical / 4);
+			uint32_t interval = _Clamp(timing.typical / 16);
+			uint32_t polls = 0;
+			
+			while(true)
+			{
+				++polls;
+				bool result = (busy() == false);
+				elapsed = clock() - _start;
+				
+				if(result == true || elapsed >= timeout)
+				{
+					if(known == true) _Record(op, elapsed, polls, result);
+					
+					return result;
+				}
+				
+				uint32_t wait = interval;
+				if(elapsed < timing.typical)
+				{
+					wait = timing.typical - elapsed;
+				}
+				else
+				{
+					interval = (interval * 2 < limit) ? interval * 2 : limit;
+				}
+				_Sleep((wait < timeout - elapsed) ? wait : timeout - elapsed);
+			}
+		}
+	
+		/// @brief Дождаться готовности опросом подряд, без учёта времени и статистики
+		/// @param busy Функция опроса, возвращает true пока чип занят
+		/// @param polls Наибольшее кол-во опросов
+		/// @return false если чип не освободился
+		template<typename T>
+		bool Poll(T busy, uint32_t polls)
+		{
+			for(uint32_t i = 0; i < polls; ++i)
+			{
+				if(busy() == false)
+				{
+					_op = OP_NONE;
+					
+					return true;
+				}
+			}
+			
+			return false;
+		}
+	
+	private:
+		
+		struct source_t
+		{
+			callback_clock_t clock;
+			callback_yield_t yield;
+		};
+		
+		static source_t &_Default()
+		{
+			static source_t source = {nullptr, nullptr};
+			
+			return source;
+		}
+		
+		callback_clock_t _Clock() const
+		{
+			return (_clock != nullptr) ? _clock : _Default().clock;
+		}
+		
+		static uint32_t _Clamp(uint32_t interval)
+		{
+			if(interval < POLL_MIN) return POLL_MIN;
+			if(interval > POLL_MAX) return POLL_MAX;
+			
+			return interval;
+		}
+		
+		void _Sleep(uint32_t us)
+		{
+			callback_clock_t clock = _Clock();
+			callback_yield_t yield = (_clock != nullptr) ? _yield : _Default().yield;
+			
+			uint32_t start = clock();
+			if(yield != nullptr) yield(us);
+			while(clock() - start < us){ }
+			
+			return;
+		}
+		
+		void _Record(op_t op, uint32_t duration, uint32_t polls, bool result)
+		{
+			stats_t &stats = _stats[op];
+			
+			stats.polls += polls;
+			if(result == false)
+			{
+				stats.timeouts++;
+				
+				return;
+			}
+			
+			if(stats.count == 0 || duration < stats.min) stats.min = duration;
+			if(duration > stats.max) stats.max = duration;
+			stats.count++;
+			
+			uint64_t reference = (_timings[op].typical > 0) ? _timings[op].typical : 1;
+			uint8_t bin = 0;
+			while(bin < HIST_BINS - 1 && (uint64_t)duration * 4 >= (reference << bin)) ++bin;
+			stats.bins[bin]++;
+			
+			return;
+		}
+		
+		timing_t _timings[OP_MAX];
+		stats_t _stats[OP_MAX];
+		
+		callback_clock_t _clock = nullptr;
+		callback_yield_t _yield = nullptr;
+		op_t _op = OP_NONE;
+		uint32_t _start = 0;
+};
@@ -0,0 +1,128 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+
+/*
+	Диспетчер принятых CAN пакетов по идентификатору.
+	Обработчики хранятся в отсортированном массиве диапазонов ID, поиск бинарный.
+*/
+
+class CANDispatcherInterface
+{
+	public:
+		
+		virtual bool Dispatch(uint32_t address, bool extended, uint8_t *data, uint8_t length) = 0;
+};
+
+template <uint8_t _handler_max> 
+class CANDispatcher : public CANDispatcherInterface
+{
+	using func_rx_t = void (*)(uint32_t address, uint8_t *data, uint8_t length);
+	
+	// Стандартные и расширенные ID с одинаковым значением различаются старшим битом ключа.
+	static constexpr uint32_t KEY_EXTENDED = 0x80000000;
+	
+	struct handler_t
+	{
+		uint32_t first;				// Первый ключ диапазона
+		uint32_t last;				// Последний ключ диапазона
+		func_rx_t callback;			// Обработчик
+	};
+	
+	public:
+		
+		CANDispatcher() : _default(nullptr)
+		{
+			memset(_handlers, 0x00, sizeof(_handlers));
+		}
+		
+		/// @brief Зарегистрировать обработчик одного ID
+		/// @param address Идентификатор пакета CAN
+		/// @param callback Обработчик
+		/// @param extended Флаг exID
+		/// @return true в случае успеха, false если нет места или ID уже занят
+		bool Register(uint32_t address, func_rx_t callback, bool extended = false)
+		{
+			return RegisterRange(address, address, callback, extended);
+		}
+		
+		/// @brief Зарегистрировать обработчик диапазона ID, включая границы
+		/// @param first Первый идентификатор диапазона
+		/// @param last Последний идентификатор диапазона
+		/// @param callback Обработчик
+		/// @param extended Флаг exID
+		/// @return true в случае успеха, false если нет места или диапазон пересекается с уже занятым
+		bool RegisterRange(uint32_t first, uint32_t last, func_rx_t callback, bool extended = false)
+		{
+			if(_handlers_count >= _handler_max) return false;
+			if(callback == nullptr || first > last) return false;
+			
+			handler_t handler = { _Key(first, extended), _Key(last, extended), callback };
+			
+			uint8_t idx = _LowerBound(handler.first);
+			if(idx < _handlers_count && _handlers[idx].first <= handler.last) return false;
+			if(idx > 0 && _handlers[idx - 1].last >= handler.first) return false;
+			
+			memmove(&_handlers[idx + 1], &_handlers[idx], sizeof(handler_t) * (_handlers_count - idx));
+			_handlers[idx] = handler;
+			_handlers_count++;
+			
+			return true;
+		}
+		
+		/// @brief Задать обработчик пакетов, для которых нет зарегистрированного ID
+		/// @param callback Обработчик, может быть nullptr
+		void SetDefault(func_rx_t callback)
+		{
+			_default = callback;
+			
+			return;
+		}
+		
+		virtual bool Dispatch(uint32_t address, bool extended, uint8_t *data, uint8_t length) override
+		{
+			uint32_t key = _Key(address, extended);
+			
+			// Ищем последний диапазон, начинающийся не позже ключа.
+			uint8_t idx = _LowerBound(key + 1);
+			if(idx > 0 && _handlers[idx - 1].last >= key)
+			{
+				_handlers[idx - 1].callback(address, data, length);
+				
+				return true;
+			}
+			
+			if(_default == nullptr) return false;
+			_default(address, data, length);
+			
+			return true;
+		}
+		
+	private:
+		
+		static inline uint32_t _Key(uint32_t address, bool extended)
+		{
+			return (extended == true) ? (address | KEY_EXTENDED) : address;
+		}
+		
+		// Индекс первого обработчика с first >= key.
+		uint8_t _LowerBound(uint32_t key) const
+		{
+			uint8_t low = 0;
+			uint8_t high = _handlers_count;
+			while(low < high)
+			{
+				uint8_t mid = low + (high - low) / 2;
+				if(_handlers[mid].first < key)
+					low = mid + 1;
+				else
+					high = mid;
+			}
+			
+			return low;
+		}
+		
+		handler_t _handlers[_handler_max];
+		uint8_t _handlers_count = 0;
+		func_rx_t _default;
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <inttypes.h>
+
+/*
+	CRC-32 (IEEE 802.3) с таблицей на полубайт: 64 байта таблицы, два обращения к ней на байт.
+	Считается кусками: crc = CRC32::Update(CRC32::INIT, ...); ... ; result = crc ^ CRC32::XOROUT.
+*/
+
+class CRC32
+{
+	public:
+		
+		static constexpr uint32_t INIT = 0xFFFFFFFF;
+		static constexpr uint32_t XOROUT = 0xFFFFFFFF;
+		
+		static uint32_t Update(uint32_t crc, const uint8_t *data, uint32_t length)
+		{
+			static const uint32_t table[16] =
+			{
+				0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+				0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+			};
+			
+			while(length--)
+			{
+				crc ^= *data++;
+				crc = (crc >> 4) ^ table[crc & 0x0F];
+				crc = (crc >> 4) ^ table[crc & 0x0F];
+			}
+			
+			return crc;
+		}
+};
@@ -0,0 +1,274 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+
+/*
+	Потоковое сжатие LZSS с фиксированным окном для микроконтроллеров.
+	
+	Формат побайтовый: управляющий байт на 8 элементов (бит 0 - первый элемент), бит 1 - литерал (1 байт),
+	бит 0 - ссылка (2 байта, little-endian): 12 бит (расстояние - 1) и 4 бита (длина - MIN_MATCH).
+	Окно не больше 4096 байт, совпадения от 3 до 18 байт.
+	
+	Память: кодер - 2 * _window байт, декодер - _window байт. Поиск совпадений полным перебором окна,
+	поэтому на сжатие уходит до _window * MAX_MATCH сравнений на байт; для логов окна 256-1024 достаточно.
+	Окно декодера должно быть не меньше окна кодера.
+*/
+
+template <uint16_t _window = 512>
+class LZSSEncoder
+{
+	static_assert(_window >= 32 && _window <= 4096 && (_window & (_window - 1)) == 0, "Window must be a power of two in 32..4096");
+	
+	public:
+		
+		static constexpr uint8_t MIN_MATCH = 3;
+		static constexpr uint8_t MAX_MATCH = 18;
+		
+		LZSSEncoder()
+		{
+			Reset();
+		}
+		
+		void Reset()
+		{
+			_start = 0;
+			_end = 0;
+			_group[0] = 0x00;
+			_group_len = 1;
+			_group_items = 0;
+			
+			return;
+		}
+		
+		/// @brief Сжать очередные данные
+		/// @param out Функция out(const uint8_t *data, uint8_t length), получает готовые группы сжатых данных
+		template<typename T>
+		void Write(const uint8_t *data, uint32_t length, T &&out)
+		{
+			while(length > 0)
+			{
+				if(_end == sizeof(_buffer)) _Shift();
+				
+				uint32_t count = sizeof(_buffer) - _end;
+				if(count > length) count = length;
+				
+				memcpy(_buffer + _end, data, count);
+				_end += count;
+				data += count;
+				length -= count;
+				
+				while(_end - _start >= MAX_MATCH) _Step(out);
+			}
+			
+			return;
+		}
+		
+		/// @brief Дожать остаток и выдать последнюю группу. После этого кодер готов к новому потоку.
+		template<typename T>
+		void Finish(T &&out)
+		{
+			while(_start < _end) _Step(out);
+			if(_group_items > 0) out(_group, _group_len);
+			
+			Reset();
+			
+			return;
+		}
+	
+	private:
+		
+		void _Shift()
+		{
+			// Сюда попадаем, когда впереди меньше MAX_MATCH байт, т.е. _start > _window.
+			uint16_t shift = _start - _window;
+			memmove(_buffer, _buffer + shift, _end - shift);
+			_start -= shift;
+			_end -= shift;
+			
+			return;
+		}
+		
+		template<typename T>
+		void _Step(T &out)
+		{
+			uint16_t max = _end - _start;
+			if(max > MAX_MATCH) max = MAX_MATCH;
+			uint16_t limit = (_start < _window) ? _start : _window;
+			
+			const uint8_t *current = _buffer + _start;
+			uint16_t best_len = 0;
+			uint16_t best_dist = 0;
+			for(uint16_t dist = 1; dist <= limit; ++dist)
+			{
+				const uint8_t *candidate = current - dist;
+				if(candidate[0] != current[0]) continue;
+				
+				// Совпадение может заходить на текущую позицию: декодер копирует побайтно.
+				uint16_t len = 1;
+				while(len < max && candidate[len] == current[len]) ++len;
+				
+				if(len > best_len)
+				{
+					best_len = len;
+					best_dist = dist;
+					if(len == max) break;
+				}
+			}
+			
+			if(best_len >= MIN_MATCH)
+			{
+				uint16_t token = ((best_dist - 1) << 4) | (best_len - MIN_MATCH);
+				_group[_group_len++] = token & 0xFF;
+				_group[_group_len++] = token >> 8;
+				_start += best_len;
+			}
+			else
+			{
+				_group[0] |= (1 << _group_items);
+				_group[_group_len++] = _buffer[_start++];
+			}
+			
+			if(++_group_items == 8)
+			{
+				out(_group, _group_len);
+				_group[0] = 0x00;
+				_group_len = 1;
+				_group_items = 0;
+			}
+			
+			return;
+		}
+		
+		uint8_t _buffer[_window * 2];
+		uint16_t _start;
+		uint16_t _end;
+		
+		uint8_t _group[1 + 8 * 2];
+		uint8_t _group_len;
+		uint8_t _group_items;
+};
+
+template <uint16_t _window = 512>
+class LZSSDecoder
+{
+	static_assert(_window >= 32 && _window <= 4096 && (_window & (_window - 1)) == 0, "Window must be a power of two in 32..4096");
+	
+	static constexpr uint8_t MIN_MATCH = 3;
+	
+	public:
+		
+		LZSSDecoder()
+		{
+			Reset();
+		}
+		
+		void Reset()
+		{
+			_head = 0;
+			_control = 0x00;
+			_items = 0;
+			_copy_dist = 0;
+			_copy_len = 0;
+			_first = 0;
+			_pending = false;
+			_in_pos = 0;
+			_in_len = 0;
+			
+			return;
+		}
+		
+		/// @brief Распаковать очередные данные. Конец потока по сжатым данным не виден, длину ограничивает вызывающий.
+		/// Если in() вернула 0, можно повторить вызов позже - состояние сохраняется.
+		/// @param in Функция in(uint8_t *data, uint32_t length), возвращает кол-во прочитанных сжатых байт
+		/// @return Кол-во распакованных байт, меньше length если сжатые данные кончились
+		template<typename T>
+		uint32_t Read(uint8_t *data, uint32_t length, T &&in)
+		{
+			uint32_t done = 0;
+			while(done < length)
+			{
+				if(_copy_len > 0)
+				{
+					uint8_t byte = _history[(_head - _copy_dist) & (_window - 1)];
+					_Put(byte);
+					data[done++] = byte;
+					_copy_len--;
+					
+					continue;
+				}
+				
+				// Ссылка, у которой прочитан только первый байт (сжатые данные кончились посередине), дочитывается при следующем вызове.
+				if(_pending == false)
+				{
+					if(_items == 0)
+					{
+						if(_Get(in, _control) == false) break;
+						_items = 8;
+					}
+					
+					if(_Get(in, _first) == false) break;
+					
+					bool literal = (_control & 0x01);
+					_control >>= 1;
+					_items--;
+					
+					if(literal == true)
+					{
+						_Put(_first);
+						data[done++] = _first;
+						
+						continue;
+					}
+					_pending = true;
+				}
+				
+				uint8_t second;
+				if(_Get(in, second) == false) break;
+				_pending = false;
+				
+				uint16_t token = _first | (second << 8);
+				_copy_dist = (token >> 4) + 1;
+				_copy_len = (token & 0x0F) + MIN_MATCH;
+			}
+			
+			return done;
+		}
+	
+	private:
+		
+		template<typename T>
+		bool _Get(T &in, uint8_t &byte)
+		{
+			if(_in_pos == _in_len)
+			{
+				_in_len = in(_in, sizeof(_in));
+				_in_pos = 0;
+				if(_in_len == 0) return false;
+			}
+			byte = _in[_in_pos++];
+			
+			return true;
+		}
+		
+		void _Put(uint8_t byte)
+		{
+			_history[_head] = byte;
+			_head = (_head + 1) & (_window - 1);
+			
+			return;
+		}
+		
+		uint8_t _history[_window];
+		uint16_t _head;
+		
+		uint8_t _control;
+		uint8_t _items;
+		uint16_t _copy_dist;
+		uint8_t _copy_len;
+		uint8_t _first;
+		bool _pending;
+		
+		uint8_t _in[32];
+		uint8_t _in_pos;
+		uint8_t _in_len;
+};
@@ -0,0 +1,340 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include "LZSS.h"
+#include "CRC32.h"
+#include "NORReader.h"
+
+/*
+	Сжатые потоки в NOR памяти (LZSS, см. LZSS.h).
+	
+	Поток - заголовок header_t (32 байта) и сжатые данные сразу за ним. Писатель сжимает данные по мере
+	поступления, набирает страницу и программирует её целиком, стирая сектора по мере продвижения.
+	Заголовок с CRC32 сжатых данных пишется последним в Close(), поэтому недописанный поток (сброс, пропало
+	питание) остаётся с пустым заголовком и читателем не открывается.
+	
+	Для лога потоки пишутся друг за другом: следующий начинается с NextAddress() предыдущего. Поток, начатый
+	с начала сектора, стирает этот сектор; начатый с середины проверяет, что остаток сектора чист (0xFF),
+	и иначе не открывается: стереть его можно только вместе с предыдущими потоками.
+	Читатель распаковывает на лету, сжатые данные читаются через NORReader кусками по _chunk_size байт,
+	так что по шине идут только сжатые байты. Open() по умолчанию сначала сверяет CRC, это ещё одно чтение
+	сжатых данных.
+*/
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "NORCompressed header format is little-endian");
+
+struct NORCompressedHeader
+{
+	static constexpr uint32_t SIZE = 32;
+	
+	uint8_t magic[4];				// "LZS2"
+	uint8_t window_bits;			// log2 окна кодера
+	uint8_t reserved[3];
+	uint32_t raw_length;			// Длина исходных данных
+	uint32_t packed_length;			// Длина сжатых данных, без заголовка
+	uint32_t packed_crc;			// CRC32 сжатых данных
+	uint8_t reserved2[12];
+	
+	static uint8_t WindowBits(uint16_t window)
+	{
+		uint8_t bits = 0;
+		while((1U << bits) < window) ++bits;
+		
+		return bits;
+	}
+	
+	/// @brief Адрес сразу за потоком, выровненный на размер заголовка
+	static uint32_t NextAddress(uint32_t address, uint32_t packed_length)
+	{
+		uint32_t end = address + SIZE + packed_length;
+		
+		return (end + SIZE - 1) & ~(SIZE - 1);
+	}
+};
+static_assert(sizeof(NORCompressedHeader) == NORCompressedHeader::SIZE, "NORCompressed header must be 32 bytes");
+
+template <typename _nor_t, uint16_t _window = 512>
+class NORCompressedWriter
+{
+	using header_t = NORCompressedHeader;
+	
+	public:
+		
+		NORCompressedWriter(_nor_t &nor) : _nor(nor)
+		{}
+		
+		/// @brief Начать поток
+		/// @param address Адрес начала, кратный 32
+		/// @param limit Место под поток вместе с заголовком, 0 - до конца памяти
+		/// @return false если адрес не подходит, остаток сектора не чист или не прочитался
+		bool Open(uint32_t address, uint32_t limit = 0)
+		{
+			_open = false;
+			if(address % header_t::SIZE != 0 || address + header_t::SIZE > _nor_t::NOR_MEM_SIZE) return false;
+			
+			uint32_t left = _nor_t::NOR_MEM_SIZE - address;
+			if(limit == 0 || limit > left) limit = left;
+			if(limit < header_t::SIZE) return false;
+			
+			_address = address;
+			_end = address + limit;
+			_write = address + header_t::SIZE;
+			_erased = address - (address % _nor_t::NOR_SECTOR_SIZE);
+			if(_erased != address)
+			{
+				_erased += _nor_t::NOR_SECTOR_SIZE;
+				if(_IsBlank(address, ((_erased < _end) ? _erased : _end) - address) == false) return false;
+			}
+			_page_len = 0;
+			_raw = 0;
+			_crc = CRC32::INIT;
+			_error = false;
+			_encoder.Reset();
+			_open = true;
+			
+			return true;
+		}
+		
+		/// @brief Добавить данные в поток
+		/// @return false если поток не открыт или не поместился в отведённое место
+		bool Write(const uint8_t *data, uint32_t length)
+		{
+			if(_open == false || _error == true) return false;
+			
+			_raw += length;
+			_encoder.Write(data, length, [this](const uint8_t *group, uint8_t count){ _Emit(group, count); });
+			
+			return (_error == false);
+		}
+		
+		/// @brief Закончить поток: дописать остаток и заголовок
+		/// @return Размер потока в памяти вместе с заголовком, 0 при ошибке
+		uint32_t Close()
+		{
+			if(_open == false) return 0;
+			_open = false;
+			
+			_encoder.Finish([this](const uint8_t *group, uint8_t count){ _Emit(group, count); });
+			_FlushPage();
+			if(_error == true) return 0;
+			
+			header_t header = {{'L', 'Z', 'S', '2'}, header_t::WindowBits(_window), {0xFF, 0xFF, 0xFF}, _raw, _write - _address - header_t::SIZE, _crc ^ CRC32::XOROUT, {}};
+			memset(header.reserved2, 0xFF, sizeof(header.reserved2));
+			_EnsureErased(_address + header_t::SIZE);
+			_nor.WriteBytes(_address, (uint8_t *) &header, sizeof(header));
+			
+			return _write - _address;
+		}
+		
+		/// @brief Адрес для следующего потока после Close()
+		uint32_t NextAddress() const
+		{
+			return header_t::NextAddress(_address, _write - _address - header_t::SIZE);
+		}
+		
+		/// @brief Кол-во исходных байт в текущем потоке
+		uint32_t RawLength() const
+		{
+			return _raw;
+		}
+		
+		/// @brief Кол-во сжатых байт в текущем потоке, включая ещё не записанную страницу
+		uint32_t PackedLength() const
+		{
+			return _write - _address - header_t::SIZE + _page_len;
+		}
+	
+	private:
+		
+		void _Emit(const uint8_t *data, uint8_t length)
+		{
+			for(uint8_t i = 0; i < length && _error == false; ++i)
+			{
+				if(_write + _page_len >= _end)
+				{
+					_error = true;
+					break;
+				}
+				
+				_page[_page_len++] = data[i];
+				if((_write + _page_len) % _nor_t::NOR_PAGE_SIZE == 0) _FlushPage();
+			}
+			
+			return;
+		}
+		
+		void _FlushPage()
+		{
+			if(_page_len == 0) return;
+			
+			_crc = CRC32::Update(_crc, _page, _page_len);
+			_EnsureErased(_write + _page_len);
+			_nor.WriteBytes(_write, _page, _page_len);
+			_write += _page_len;
+			_page_len = 0;
+			
+			return;
+		}
+		
+		void _EnsureErased(uint32_t end)
+		{
+			while(_erased < end)
+			{
+				_nor.EraseSector(_erased / _nor_t::NOR_SECTOR_SIZE);
+				_erased += _nor_t::NOR_SECTOR_SIZE;
+			}
+			
+			return;
+		}
+		
+		// Область ещё не писалась со стирания. Читает в буфер страницы, поэтому только до начала записи.
+		bool _IsBlank(uint32_t address, uint32_t length)
+		{
+			while(length > 0)
+			{
+				uint32_t count = (length < sizeof(_page)) ? length : sizeof(_page);
+				if(_nor.ReadBytes(address, _page, count) == false) return false;
+				for(uint32_t i = 0; i < count; ++i)
+				{
+					if(_page[i] != 0xFF) return false;
+				}
+				address += count;
+				length -= count;
+			}
+			
+			return true;
+		}
+		
+		_nor_t &_nor;
+		LZSSEncoder<_window> _encoder;
+		
+		uint8_t _page[_nor_t::NOR_PAGE_SIZE];
+		uint16_t _page_len = 0;
+		
+		uint32_t _address = 0;
+		uint32_t _end = 0;
+		uint32_t _write = 0;			// Адрес первого незаписанного байта
+		uint32_t _erased = 0;			// Граница стёртой области
+		uint32_t _raw = 0;
+		uint32_t _crc = 0;
+		bool _open = false;
+		bool _error = false;
+};
+
+template <typename _nor_t, uint16_t _window = 512, uint16_t _chunk_size = 64>
+class NORCompressedReader
+{
+	using header_t = NORCompressedHeader;
+	
+	public:
+		
+		NORCompressedReader(_nor_t &nor, bool hold = false) : _nor(nor), _reader(nor, hold)
+		{}
+		
+		/// @brief Открыть поток
+		/// @param address Адрес заголовка
+		/// @param check Сверить CRC сжатых данных до распаковки
+		/// @return false если по адресу нет записанного потока, окно потока больше окна читателя или CRC не сошёлся
+		bool Open(uint32_t address, bool check = true)
+		{
+			Close();
+			if(address + header_t::SIZE > _nor_t::NOR_MEM_SIZE) return false;
+			
+			if(_nor.ReadBytes(address, (uint8_t *) &_header, sizeof(_header)) == false) return false;
+			if(memcmp(_header.magic, "LZS2", sizeof(_header.magic)) != 0) return false;
+			if(_header.window_bits > header_t::WindowBits(_window)) return false;
+			if(_header.packed_length > _nor_t::NOR_MEM_SIZE - address - header_t::SIZE) return false;
+			if(check == true && _CheckCrc(address + header_t::SIZE) == false) return false;
+			
+			_address = address;
+			_left = _header.raw_length;
+			_decoder.Reset();
+			_reader.Open(address + header_t::SIZE, _header.packed_length);
+			_open = true;
+			
+			return true;
+		}
+		
+		void Close()
+		{
+			_reader.Close();
+			_open = false;
+			_left = 0;
+			
+			return;
+		}
+		
+		/// @brief Упреждающее чтение сжатых данных, см. NORReader::Prefetch()
+		bool Prefetch()
+		{
+			return _reader.Prefetch();
+		}
+		
+		/// @brief Прочитать распакованные данные с текущей позиции
+		/// @param blocking false - только из уже прочитанных сжатых данных, без обращения к шине
+		/// @return Кол-во прочитанных байт, меньше length в конце потока
+		uint32_t Read(uint8_t *data, uint32_t length, bool blocking = true)
+		{
+			if(_open == false) return 0;
+			if(length > _left) length = _left;
+			
+			uint32_t count = _decoder.Read(data, length, [this, blocking](uint8_t *buffer, uint32_t size){ return _reader.Read(buffer, size, blocking); });
+			_left -= count;
+			
+			return count;
+		}
+		
+		bool Eof() const
+		{
+			return _left == 0;
+		}
+		
+		uint32_t RawLength() const
+		{
+			return _header.raw_length;
+		}
+		
+		uint32_t PackedLength() const
+		{
+			return _header.packed_length;
+		}
+		
+		/// @brief Адрес следующего потока лога
+		uint32_t NextAddress() const
+		{
+			return header_t::NextAddress(_address, _header.packed_length);
+		}
+		
+		const typename NORReader<_nor_t, _chunk_size>::stats_t &Stats() const
+		{
+			return _reader.Stats();
+		}
+	
+	private:
+		
+		bool _CheckCrc(uint32_t address)
+		{
+			uint8_t chunk[_chunk_size];
+			uint32_t crc = CRC32::INIT;
+			uint32_t length = _header.packed_length;
+			while(length > 0)
+			{
+				uint32_t count = (length < _chunk_size) ? length : _chunk_size;
+				if(_nor.ReadBytes(address, chunk, count) == false) return false;
+				crc = CRC32::Update(crc, chunk, count);
+				address += count;
+				length -= count;
+			}
+			
+			return ((crc ^ CRC32::XOROUT) == _header.packed_crc);
+		}
+		
+		_nor_t &_nor;
+		NORReader<_nor_t, _chunk_size> _reader;
+		LZSSDecoder<_window> _decoder;
+		
+		header_t _header = {};
+		uint32_t _address = 0;
+		uint32_t _left = 0;
+		bool _open = false;
+};
@@ -0,0 +1,218 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include <atomic>
+
+/*
+	Потоковое чтение NOR памяти с упреждением и двумя буферами.
+	
+	Память читается кусками по _chunk_size байт в два буфера: пока приложение забирает данные из одного,
+	Prefetch() заполняет другой. Мелкие последовательные Read() обслуживаются из буфера без обращения к шине,
+	а команда чтения отправляется один раз на кусок, а не на каждый вызов.
+	
+	Prefetch() вызывается там, где есть время: в основном цикле, в задаче с низким приоритетом или через
+	SPIManager::Request(). Потребитель может быть в прерывании (например, ЦАП) и звать Read(..., false):
+	тогда он никогда не обращается к шине, а при пустом буфере получает меньше данных (см. stats_t::stalls).
+	Read() с blocking = true дочитывает сам и должен вызываться из того же контекста, что и Prefetch().
+	
+	ReadAt() следит за последовательностью: продолжение с текущей позиции идёт из буферов, переход на другой
+	адрес сбрасывает буферы и начинает поток заново.
+	
+	С hold = true поток читается одной командой чтения без снятия CS между кусками (ReadStreamBegin() драйвера).
+	Шина при этом занята всё время потока, поэтому такой режим только для памяти на отдельной шине.
+	Другие устройства той же шины между вызовами Read() получают отказ (шина занята): без RTOS и из той же
+	задачи под FreeRTOS - сразу, из других задач - ждут конца потока (Close()).
+	Любой другой вызов драйвера закрывает поток; следующий кусок тогда читается новой командой с текущего адреса.
+	
+	Буфер передаётся потребителю флагом _ready с release / acquire: данные куска видны раньше, чем флаг.
+*/
+
+template <typename _nor_t, uint16_t _chunk_size = 256>
+class NORReader
+{
+	public:
+		
+		struct stats_t
+		{
+			uint32_t fetches;			// Прочитано кусков
+			uint32_t stalls;			// Сколько раз Read() застал пустой буфер
+			uint32_t restarts;			// Сколько раз ReadAt() начал поток заново
+		};
+		
+		NORReader(_nor_t &nor, bool hold = false) : _nor(nor), _hold(hold)
+		{}
+		
+		~NORReader()
+		{
+			Close();
+		}
+		
+		/// @brief Начать поток
+		/// @param address Адрес первого байта
+		/// @param length Длина потока, 0 - до конца памяти. Дальше конца потока упреждение не читает.
+		void Open(uint32_t address, uint32_t length = 0)
+		{
+			Close();
+			
+			if(address > _nor_t::NOR_MEM_SIZE) address = _nor_t::NOR_MEM_SIZE;
+			uint32_t left = _nor_t::NOR_MEM_SIZE - address;
+			
+			_end = address + ((length == 0 || length > left) ? left : length);
+			_position = address;
+			_fetch_address = address;
+			_current = 0;
+			_fill_idx = 0;
+			_pos = 0;
+			_open = true;
+			
+			return;
+		}
+		
+		void Close()
+		{
+			if(_streaming == true)
+			{
+				_nor.ReadStreamEnd();
+				_streaming = false;
+			}
+			_ready[0].store(false, std::memory_order_release);
+			_ready[1].store(false, std::memory_order_release);
+			_open = false;
+			
+			return;
+		}
+		
+		/// @brief Заполнить свободный буфер
+		/// @return true если кусок прочитан
+		bool Prefetch()
+		{
+			if(_open == false || _ready[_fill_idx].load(std::memory_order_acquire) == true || _fetch_address >= _end) return false;
+			
+			return _Fetch();
+		}
+		
+		/// @brief Прочитать с текущей позиции
+		/// @param data Куда положить данные
+		/// @param length Кол-во байт
+		/// @param blocking false - только из готовых буферов, без обращения к шине
+		/// @return Кол-во прочитанных байт, меньше length в конце потока или при пустом буфере без blocking
+		uint32_t Read(uint8_t *data, uint32_t length, bool blocking = true)
+		{
+			uint32_t done = 0;
+			while(done < length && _open == true)
+			{
+				if(_ready[_current].load(std::memory_order_acquire) == false)
+				{
+					if(_position >= _end) break;
+					
+					_stats.stalls++;
+					if(blocking == false || _Fetch() == false) break;
+				}
+				
+				uint32_t count = _fill[_current] - _pos;
+				if(count > length - done) count = length - done;
+				
+				memcpy(data + done, &_buffer[_current][_pos], count);
+				_pos += count;
+				_position += count;
+				done += count;
+				
+				if(_pos == _fill[_current])
+				{
+					_pos = 0;
+					_ready[_current].store(false, std::memory_order_release);
+					_current ^= 1;
+				}
+			}
+			
+			return done;
+		}
+		
+		/// @brief Прочитать с адреса. Последовательные вызовы обслуживаются из буферов.
+		uint32_t ReadAt(uint32_t address, uint8_t *data, uint32_t length, bool blocking = true)
+		{
+			if(_open == false || address != _position)
+			{
+				if(_open == true) _stats.restarts++;
+				
+				// Граница потока сохраняется, если новый адрес внутри него.
+				uint32_t end = _end;
+				Open(address, (address < end) ? end - address : 0);
+			}
+			
+			return Read(data, length, blocking);
+		}
+		
+		uint32_t Position() const
+		{
+			return _position;
+		}
+		
+		bool Eof() const
+		{
+			return _position >= _end;
+		}
+		
+		const stats_t &Stats() const
+		{
+			return _stats;
+		}
+	
+	private:
+		
+		bool _Fetch()
+		{
+			uint8_t idx = _fill_idx;
+			uint32_t left = _end - _fetch_address;
+			uint16_t count = (left < _chunk_size) ? left : _chunk_size;
+			if(count == 0) return false;
+			
+			if(_hold == true)
+			{
+				// Поток мог закрыть другой вызов драйвера, тогда ReadStreamNext() откажет: начинаем его заново.
+				if(_streaming == false || _nor.ReadStreamNext(_buffer[idx], count) == false)
+				{
+					_streaming = false;
+					if(_nor.ReadStreamBegin(_fetch_address) == false) return false;
+					_streaming = true;
+					if(_nor.ReadStreamNext(_buffer[idx], count) == false) return false;
+				}
+			}
+			else
+			{
+				if(_nor.ReadBytes(_fetch_address, _buffer[idx], count) == false) return false;
+			}
+			
+			_fill[idx] = count;
+			_fetch_address += count;
+			_fill_idx ^= 1;
+			_stats.fetches++;
+			_ready[idx].store(true, std::memory_order_release);
+			
+			if(_streaming == true && _fetch_address >= _end)
+			{
+				_nor.ReadStreamEnd();
+				_streaming = false;
+			}
+			
+			return true;
+		}
+		
+		_nor_t &_nor;
+		bool _hold;
+		
+		uint8_t _buffer[2][_chunk_size];
+		uint16_t _fill[2] = {0, 0};
+		std::atomic<bool> _ready[2] = {{false}, {false}};
+		uint8_t _current = 0;
+		uint8_t _fill_idx = 0;
+		uint16_t _pos = 0;
+		
+		uint32_t _position = 0;
+		uint32_t _fetch_address = 0;
+		uint32_t _end = 0;
+		bool _open = false;
+		bool _streaming = false;
+		
+		stats_t _stats = {0, 0, 0};
+};
@@ -0,0 +1,309 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include "CRC32.h"
+
+/*
+	Два слота обновления прошивки (A/B) во внешней NOR памяти.
+	
+	Слот - заголовок header_t в начале первой страницы и образ со второй страницы. Обновление пишется
+	в неактивный слот: Begin() стирает первый сектор (или блок 64К), Write() принимает куски любого размера,
+	считает CRC32 на лету и программирует страницы по мере заполнения. Следующий сектор / блок стирается
+	сразу после записи последней страницы предыдущего, так что стирание идёт, пока копится следующая страница.
+	
+	Finish() дописывает хвост, читает образ из памяти кусками по _chunk_size байт, считает CRC и сравнивает
+	с посчитанной при записи. Только после совпадения пишется заголовок с номером больше, чем у другого слота:
+	слот без заголовка (сброс во время обновления, ошибка проверки) не считается рабочим.
+	Active() - слот с корректным заголовком и большим номером, Invalidate() снимает слот (откат на другой).
+	Active() без проверки смотрит только заголовок: перед запуском образа загрузчик должен вызвать Active(true),
+	который пропускает слоты с несовпавшим CRC (откат на другой слот), или Verify().
+	
+	Раскладка проверяется в конструкторе: слоты выровнены на сектор, размер кратен сектору, слоты не пересекаются
+	и помещаются в память. С неверной раскладкой (LayoutOk() == false) слоты не читаются и не пишутся,
+	так что стирание не может задеть рабочий слот.
+*/
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "NORUpdateSlots header format is little-endian");
+
+template <typename _nor_t, uint16_t _chunk_size = 64>
+class NORUpdateSlots
+{
+	public:
+		
+		static constexpr uint8_t SLOT_COUNT = 2;
+		static constexpr int8_t SLOT_NONE = -1;
+		
+		struct header_t
+		{
+			uint8_t magic[4];			// "FWUP"
+			uint32_t sequence;			// Номер обновления, у активного слота больший
+			uint32_t version;			// Версия прошивки, на усмотрение приложения
+			uint32_t length;			// Длина образа
+			uint32_t crc;				// CRC32 образа
+			uint8_t reserved[12];
+		};
+		static_assert(sizeof(header_t) == 32, "NORUpdateSlots header must be 32 bytes");
+		
+		/// @param slot0 Адрес первого слота, кратный сектору
+		/// @param slot1 Адрес второго слота, кратный сектору
+		/// @param slot_size Размер слота, кратный сектору
+		NORUpdateSlots(_nor_t &nor, uint32_t slot0, uint32_t slot1, uint32_t slot_size) : _nor(nor), _slot{slot0, slot1}, _slot_size(slot_size)
+		{
+			_layout_ok = _CheckLayout();
+		}
+		
+		/// @brief Раскладка слотов корректна, см. описание класса
+		bool LayoutOk() const
+		{
+			return _layout_ok;
+		}
+		
+		/// @brief Адрес образа в слоте
+		uint32_t ImageAddress(uint8_t slot) const
+		{
+			return _slot[slot % SLOT_COUNT] + _nor_t::NOR_PAGE_SIZE;
+		}
+		
+		/// @brief Максимальная длина образа
+		uint32_t ImageMax() const
+		{
+			return _slot_size - _nor_t::NOR_PAGE_SIZE;
+		}
+		
+		/// @brief Прочитать заголовок слота
+		/// @return false если слот пуст, не дописан или снят
+		bool GetHeader(uint8_t slot, header_t &header)
+		{
+			if(_layout_ok == false || slot >= SLOT_COUNT) return false;
+			
+			if(_nor.ReadBytes(_slot[slot], (uint8_t *) &header, sizeof(header)) == false) return false;
+			
+			return (memcmp(header.magic, "FWUP", sizeof(header.magic)) == 0 && header.length <= ImageMax());
+		}
+		
+		/// @brief Рабочий слот: с корректным заголовком и большим номером
+		/// @param verify Пропускать слоты, образ которых не сходится с CRC заголовка (читает образы целиком)
+		/// @return Номер слота или SLOT_NONE
+		int8_t Active(bool verify = false)
+		{
+			int8_t result = SLOT_NONE;
+			uint32_t sequence = 0;
+			for(uint8_t slot = 0; slot < SLOT_COUNT; ++slot)
+			{
+				header_t header;
+				if(GetHeader(slot, header) == false) continue;
+				if(verify == true && Verify(slot) == false) continue;
+				
+				if(result == SLOT_NONE || header.sequence > sequence)
+				{
+					result = slot;
+					sequence = header.sequence;
+				}
+			}
+			
+			return result;
+		}
+		
+		/// @brief Начать запись обновления в неактивный слот
+		/// @param length Длина образа
+		/// @param version Версия, попадёт в заголовок
+		/// @return false если образ не помещается или раскладка слотов неверна
+		bool Begin(uint32_t length, uint32_t version)
+		{
+			Abort();
+			
+			if(_layout_ok == false) return false;
+			if(length == 0 || length > ImageMax()) return false;
+			
+			_target = (Active() == 0) ? 1 : 0;
+			_version = version;
+			_write = ImageAddress(_target);
+			_end = _write + length;
+			_erased = _slot[_target];
+			_page_len = 0;
+			_crc = CRC32::INIT;
+			_writing = true;
+			
+			// Первый сектор вместе со страницей заголовка: старый заголовок стирается до записи образа.
+			_EraseAhead();
+			
+			return true;
+		}
+		
+		/// @brief Добавить очередной кусок образа
+		/// @return false если запись не начата или данных больше заявленной длины
+		bool Write(const uint8_t *data, uint32_t length)
+		{
+			if(_writing == false) return false;
+			if(length > _end - _write - _page_len)
+			{
+				Abort();
+				
+				return false;
+			}
+			
+			_crc = CRC32::Update(_crc, data, length);
+			while(length > 0)
+			{
+				uint32_t count = _nor_t::NOR_PAGE_SIZE - _page_len;
+				if(count > length) count = length;
+				
+				memcpy(_page + _page_len, data, count);
+				_page_len += count;
+				data += count;
+				length -= count;
+				
+				if(_page_len == _nor_t::NOR_PAGE_SIZE) _FlushPage();
+			}
+			
+			return true;
+		}
+		
+		/// @brief Закончить запись: дописать хвост, проверить образ в памяти и записать заголовок
+		/// @return true если образ принят и слот стал активным
+		bool Finish()
+		{
+			if(_writing == false) return false;
+			_writing = false;
+			
+			_FlushPage();
+			if(_write != _end) return false;
+			
+			uint32_t image = ImageAddress(_target);
+			uint32_t crc = _crc ^ CRC32::XOROUT;
+			uint32_t check;
+			if(_ImageCrc(image, _end - image, check) == false || check != crc) return false;
+			
+			header_t header;
+			uint32_t sequence = 0;
+			if(GetHeader(_target ^ 1, header) == true) sequence = header.sequence;
+			
+			header = {{'F', 'W', 'U', 'P'}, sequence + 1, _version, _end - image, crc, {}};
+			memset(header.reserved, 0xFF, sizeof(header.reserved));
+			_nor.WriteBytes(_slot[_target], (uint8_t *) &header, sizeof(header));
+			if(_nor.WaitReady() == false) return false;
+			
+			return (Active() == _target);
+		}
+		
+		/// @brief Прервать запись. Слот остаётся без заголовка.
+		void Abort()
+		{
+			_writing = false;
+			_page_len = 0;
+			
+			return;
+		}
+		
+		/// @brief Проверить образ слота по CRC из заголовка (например, загрузчиком перед запуском)
+		bool Verify(uint8_t slot)
+		{
+			header_t header;
+			if(GetHeader(slot, header) == false) return false;
+			
+			uint32_t crc;
+			if(_ImageCrc(ImageAddress(slot), header.length, crc) == false) return false;
+			
+			return (crc == header.crc);
+		}
+		
+		/// @brief Снять слот: затереть сигнатуру заголовка без стирания сектора
+		void Invalidate(uint8_t slot)
+		{
+			if(_layout_ok == false || slot >= SLOT_COUNT) return;
+			
+			uint8_t zero[4] = {};
+			_nor.WriteBytes(_slot[slot], zero, sizeof(zero));
+			_nor.WaitReady();
+			
+			return;
+		}
+		
+		/// @brief Кол-во принятых байт текущего обновления
+		uint32_t Written() const
+		{
+			return (_writing == true) ? _write + _page_len - ImageAddress(_target) : 0;
+		}
+	
+	private:
+		
+		bool _CheckLayout() const
+		{
+			const uint32_t sector = _nor_t::NOR_SECTOR_SIZE;
+			if(_slot_size < 2 * _nor_t::NOR_PAGE_SIZE || _slot_size % sector != 0) return false;
+			
+			for(uint8_t slot = 0; slot < SLOT_COUNT; ++slot)
+			{
+				if(_slot[slot] % sector != 0) return false;
+				if(_slot[slot] > _nor_t::NOR_MEM_SIZE || _slot_size > _nor_t::NOR_MEM_SIZE - _slot[slot]) return false;
+			}
+			
+			// Слоты не пересекаются: один целиком до другого.
+			return (_slot[0] + _slot_size <= _slot[1] || _slot[1] + _slot_size <= _slot[0]);
+		}
+		
+		void _FlushPage()
+		{
+			if(_page_len == 0) return;
+			
+			while(_write + _page_len > _erased) _EraseAhead();
+			_nor.WriteBytes(_write, _page, _page_len);
+			_write += _page_len;
+			_page_len = 0;
+			
+			// Стёртое кончилось - сразу стираем дальше, пока копится следующая страница.
+			if(_write == _erased && _write < _end) _EraseAhead();
+			
+			return;
+		}
+		
+		void _EraseAhead()
+		{
+			if(_erased % _nor_t::NOR_BLOCK64_SIZE == 0 && _end - _erased >= _nor_t::NOR_BLOCK64_SIZE)
+			{
+				_nor.EraseBlock64(_erased / _nor_t::NOR_BLOCK64_SIZE);
+				_erased += _nor_t::NOR_BLOCK64_SIZE;
+			}
+			else
+			{
+				_nor.EraseSector(_erased / _nor_t::NOR_SECTOR_SIZE);
+				_erased += _nor_t::NOR_SECTOR_SIZE;
+			}
+			
+			return;
+		}
+		
+		// false если образ не удалось прочитать.
+		bool _ImageCrc(uint32_t address, uint32_t length, uint32_t &result)
+		{
+			uint8_t chunk[_chunk_size];
+			uint32_t crc = CRC32::INIT;
+			while(length > 0)
+			{
+				uint32_t count = (length < _chunk_size) ? length : _chunk_size;
+				if(_nor.ReadBytes(address, chunk, count) == false) return false;
+				crc = CRC32::Update(crc, chunk, count);
+				address += count;
+				length -= count;
+			}
+			result = crc ^ CRC32::XOROUT;
+			
+			return true;
+		}
+		
+		_nor_t &_nor;
+		uint32_t _slot[SLOT_COUNT];
+		uint32_t _slot_size;
+		bool _layout_ok = false;
+		
+		uint8_t _page[_nor_t::NOR_PAGE_SIZE];
+		uint16_t _page_len = 0;
+		
+		uint8_t _target = 0;
+		uint32_t _version = 0;
+		uint32_t _write = 0;			// Адрес первого незаписанного байта образа
+		uint32_t _end = 0;
+		uint32_t _erased = 0;			// Граница стёртой области
+		uint32_t _crc = 0;
+		bool _writing = false;
+};
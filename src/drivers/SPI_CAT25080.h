@@ -1,7 +1,9 @@
 #pragma once
 #include <inttypes.h>
+#include <string.h>
 #include <SPIManager.h>
 #include <DrakePinD.hpp>
+#include "BusyWait.h"
 
 /*
 	Класс работы с SPI EEPROM памятью.
@@ -27,15 +29,18 @@ class SPI_CAT25080 : public SPIDeviceInterface
 		
 		SPI_CAT25080(const DrakePin::PinD_t &cs_pin, uint32_t spi_prescaler) : SPIDeviceInterface(cs_pin, spi_prescaler)
 		{
-
+			// Времена операций, мкс: типовое и максимальное.
+			_busy.SetTiming(BusyWait::OP_PROGRAM, 2000, 5000);
 		}
 
 		virtual void Init() override
 		{
 			// Сброс состояния eeprom, т.к. нету команды сброса.
-			DeviceActivate();
+			if(DeviceActivate() == false) return;
 			DeviceDeactivate();
 			
+			_probe_valid = ProbeRead(_probe_status);
+			
 			return;
 		}
 		
@@ -44,20 +49,38 @@ class SPI_CAT25080 : public SPIDeviceInterface
 			return;
 		}
 		
+		/// @brief Ожидание записи и стирания: источник времени, времена операций, статистика
+		BusyWait &Busy()
+		{
+			return _busy;
+		}
+		
+		/// @brief Взвести и сбросить WEL, сравнив статус с прочитанным в Init(). Память и биты защиты не пишутся.
+		/// Если в Init() чип не ответил, проверки нет (PROBE_NONE). Во время записи WREN не принимается: PROBE_FAIL.
+		virtual probe_t DeviceProbe() override
+		{
+			if(_probe_valid == false) return PROBE_NONE;
+			
+			uint8_t status;
+			if(ProbeRead(status) == false || status != _probe_status) return PROBE_FAIL;
+			
+			return PROBE_OK;
+		}
+		
 		/// @brief Прочитать байт
 		/// @param address Адрес байта
-		/// @return Прочитанный байт
+		/// @return Прочитанный байт, 0xFF если чип не освободился или шина занята
 		uint8_t ReadByte(uint16_t address)
 		{
 			if(address > EEPROM_MAX_ADDRESS) return 0xFF;
 			if(WaitReady() == false) return 0xFF;
 			
-			uint8_t result[1];
+			uint8_t result[1] = {0xFF};
 			
-			DeviceActivate();
-			SendCmd3(CMD_READ_DATA, address);
-			_spi_interface->ReceiveData(result, sizeof(result));
-			DeviceDeactivate();
+			uint8_t cmd[3];
+			FillCmd3(cmd, CMD_READ_DATA, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(result, sizeof(result)) };
+			if(DeviceTransfer(segments) == false) return 0xFF;
 			
 			return result[0];
 		}
@@ -65,17 +88,18 @@ class SPI_CAT25080 : public SPIDeviceInterface
 		/// @brief Прочитать станицу, 32 байта
 		/// @param page Номер старницы
 		/// @param data Массив для записи
-		void ReadPage(uint16_t page, uint8_t *data)
+		/// @return false если чип не освободился или шина занята
+		bool ReadPage(uint16_t page, uint8_t *data)
 		{
-			if(page > EEPROM_MAX_PAGE) return;
-			if(WaitReady() == false) return;
+			if(page > EEPROM_MAX_PAGE) return false;
+			if(WaitReady() == false) return false;
 
-			DeviceActivate();
-			SendCmd3(CMD_READ_DATA, (page * EEPROM_PAGE_SIZE));
-			_spi_interface->ReceiveData(data, EEPROM_PAGE_SIZE);
-			DeviceDeactivate();
+			uint8_t cmd[3];
+			FillCmd3(cmd, CMD_READ_DATA, (page * EEPROM_PAGE_SIZE));
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, EEPROM_PAGE_SIZE) };
+			if(DeviceTransfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 		
 		/// @brief Прочитать данные в объект
@@ -89,10 +113,10 @@ class SPI_CAT25080 : public SPIDeviceInterface
 			if(address + sizeof(T) > EEPROM_MAX_ADDRESS) return false;
 			if(WaitReady() == false) return false;
 			
-			DeviceActivate();
-			SendCmd3(CMD_READ_DATA, address);
-			_spi_interface->ReceiveData((uint8_t *) &data, sizeof(T));
-			DeviceDeactivate();
+			uint8_t cmd[3];
+			FillCmd3(cmd, CMD_READ_DATA, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx((uint8_t *) &data, sizeof(T)) };
+			if(DeviceTransfer(segments) == false) return false;
 			
 			return true;
 		}
@@ -106,11 +130,12 @@ class SPI_CAT25080 : public SPIDeviceInterface
 			if(address > EEPROM_MAX_ADDRESS) return;
 			if(WaitReady() == false) return;
 			
-			WriteEnable();
-			DeviceActivate();
-			SendCmd3(CMD_WRITE_DATA, address);
-			_spi_interface->TransmitData((uint8_t *) &data, 1);
-			DeviceDeactivate();
+			if(WriteEnable() == false) return;
+			uint8_t cmd[3];
+			FillCmd3(cmd, CMD_WRITE_DATA, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Tx((uint8_t *) &data, 1) };
+			if(DeviceTransfer(segments) == false) return;
+			_busy.Start(BusyWait::OP_PROGRAM);
 			
 			return;
 		}
@@ -123,11 +148,12 @@ class SPI_CAT25080 : public SPIDeviceInterface
 			if(page > EEPROM_MAX_PAGE) return;
 			if(WaitReady() == false) return;
 			
-			WriteEnable();
-			DeviceActivate();
-			SendCmd3(CMD_WRITE_DATA, (page * EEPROM_PAGE_SIZE));
-			_spi_interface->TransmitData(data, EEPROM_PAGE_SIZE);
-			DeviceDeactivate();
+			if(WriteEnable() == false) return;
+			uint8_t cmd[3];
+			FillCmd3(cmd, CMD_WRITE_DATA, (page * EEPROM_PAGE_SIZE));
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Tx(data, EEPROM_PAGE_SIZE) };
+			if(DeviceTransfer(segments) == false) return;
+			_busy.Start(BusyWait::OP_PROGRAM);
 			
 			return;
 		}
@@ -160,33 +186,35 @@ class SPI_CAT25080 : public SPIDeviceInterface
 		}
 		
 		
-		void WriteEnable()
+		/// @return false если шина занята
+		bool WriteEnable()
 		{
-			DeviceActivate();
+			if(DeviceActivate() == false) return false;
 			SendCmd1(CMD_WRITE_ENABLE);
 			DeviceDeactivate();
 
-			return;
+			return true;
 		}
 		
-		bool WaitReady(uint32_t delay = 100000)
+		bool WaitReady()
 		{
-			while((ReadStatus() & 0x01) == 0x01)
-			{
-				if(--delay == 0) return false;
-			}
-			
-			return true;
+			return _busy.Wait([this]() { return (ReadStatus() & 0x01) != 0; });
+		}
+		
+		/// @brief Ждать готовности не более delay опросов статуса подряд, без учёта времени
+		bool WaitReady(uint32_t delay)
+		{
+			return _busy.Poll([this]() { return (ReadStatus() & 0x01) != 0; }, delay);
 		}
 		
+		/// @return Регистр статуса. Если шина занята - 0xFF, т.е. чип считается занятым.
 		uint8_t ReadStatus()
 		{
-			uint8_t result[1];
+			uint8_t result[1] = {0xFF};
 			
-			DeviceActivate();
-			SendCmd1(CMD_READ_STATUS);
-			_spi_interface->ReceiveData(result, sizeof(result));
-			DeviceDeactivate();
+			uint8_t cmd[1] = {CMD_READ_STATUS};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(result, sizeof(result)) };
+			if(DeviceTransfer(segments) == false) return 0xFF;
 			
 			return result[0];
 		}
@@ -199,16 +227,47 @@ class SPI_CAT25080 : public SPIDeviceInterface
 			_spi_interface->TransmitData(data, sizeof(data));
 		}
 		
-		void SendCmd3(uint8_t cmd, uint16_t address)
+		static void FillCmd3(uint8_t (&data)[3], uint8_t cmd, uint16_t address)
 		{
-			uint8_t data[3];
 			data[0] = cmd;
 			data[1] = (address >> 8) & 0xFF;
 			data[2] = address & 0xFF;
+		}
+		
+		void SendCmd3(uint8_t cmd, uint16_t address)
+		{
+			uint8_t data[3];
+			FillCmd3(data, cmd, address);
 			
 			_spi_interface->TransmitData(data, sizeof(data));
 		}
 		
 	private:
-	
+		
+		bool ProbeRead(uint8_t &status)
+		{
+			uint8_t wren[1] = {CMD_WRITE_ENABLE};
+			uint8_t wrdi[1] = {CMD_WRITE_DISABLE};
+			uint8_t cmd[1] = {CMD_READ_STATUS};
+			uint8_t set[1] = {};
+			uint8_t clear[1] = {};
+			SPIManagerInterface::segment_t segments_wren[] = { SPIManagerInterface::Tx(wren, sizeof(wren)) };
+			SPIManagerInterface::segment_t segments_set[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(set, sizeof(set)) };
+			SPIManagerInterface::segment_t segments_wrdi[] = { SPIManagerInterface::Tx(wrdi, sizeof(wrdi)) };
+			SPIManagerInterface::segment_t segments_clear[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(clear, sizeof(clear)) };
+			if(DeviceTransfer(segments_wren) == false || DeviceTransfer(segments_set) == false) return false;
+			if(DeviceTransfer(segments_wrdi) == false || DeviceTransfer(segments_clear) == false) return false;
+			
+			// Линия MISO, висящая в 0 или 1, не даст WEL = 1 после WREN и WEL = 0 после WRDI.
+			// RDY и WEL в остальное время меняются сами по себе, сравниваются только WPEN и BP.
+			if(set[0] == 0x00 || set[0] == 0xFF) return false;
+			if((set[0] & 0x02) == 0 || (clear[0] & 0x02) != 0 || (set[0] & 0x8C) != (clear[0] & 0x8C)) return false;
+			status = set[0] & 0x8C;
+			
+			return true;
+		}
+		
+		BusyWait _busy;
+		uint8_t _probe_status = 0x00;
+		bool _probe_valid = false;
 };
@@ -5,20 +5,62 @@
 #include <DrakePinD.hpp>
 
 /*
-
+	Входы цепочки 74HC165 с подавлением дребезга.
+	Дребезг подавляется вертикальным счётчиком: 3-битный счётчик на каждый вход хранится в трёх байтах
+	на микросхему (по биту на вход), поэтому выборка обрабатывает все 8 входов байта одной серией AND/XOR.
+	Вход меняет состояние, когда stable_count выборок подряд отличаются от текущего состояния.
+	Изменения складываются в кольцевой буфер событий (нажатие, отпускание, длительное нажатие).
+	Буферы обрабатываются 32-битными словами, по изменившимся битам идём через count trailing zeros.
+	
+	По умолчанию цепочка опрашивается с периодом выборки. В режиме SetTriggerMode() опрос идёт по Trigger(),
+	который вызывается из прерывания линии "любой вход изменился", а пока дребезг не подавлен или ждётся
+	длительное нажатие - с периодом выборки. Без изменений остаётся только редкий страховочный опрос.
+	
+	Выборку можно включить в пакет менеджера: BatchAdd(hc165, hc165.BatchSegment(), 1, hc165.BatchLoad),
+	а по завершении пакета вызвать Process().
+	
+	_manager_t - тип менеджера шины: с SPIStaticManager выборка идёт без виртуальных вызовов (см. SPIStaticManager.h).
 */
 
-template <uint8_t _dev_count> 
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "SPI_HC165 word processing expects little-endian byte order");
+
+template <uint8_t _dev_count, uint8_t _event_max = 16, typename _manager_t = SPIManagerInterface> 
 class SPI_HC165 : public SPIDeviceInterface
 {
 	using func_change_t = void (*)(uint8_t device, uint8_t pin, bool state);
+	using func_bulk_t = void (*)(const uint8_t *changed, const uint8_t *state, uint8_t length);
+	
+	// Байт N цепочки лежит в слове N / 4, биты (N % 4) * 8 .. +7.
+	static constexpr uint8_t WORDS = (_dev_count + 3) / 4;
+	
+	union buffer_t
+	{
+		uint8_t bytes[WORDS * 4];
+		uint32_t words[WORDS];
+	};
 	
 	public:
+		
+		enum event_type_t : uint8_t
+		{
+			EVENT_PRESS,
+			EVENT_RELEASE,
+			EVENT_LONG_PRESS,
+		};
+		
+		struct event_t
+		{
+			uint8_t device;
+			uint8_t pin;
+			event_type_t type;
+		};
+		
 		SPI_HC165(const DrakePin::PinD_t &cs_pin, const DrakePin::PinD_t &latch_pin, uint32_t spi_prescaler) : 
 			SPIDeviceInterface(cs_pin, spi_prescaler), 
 			_latch_pin(latch_pin, DrakePin::Output, DrakePin::High)
 		{
 			//_spi_config.first_bit = SPI_FIRSTBIT_LSB;
+			_batch_segment = SPIManagerInterface::Rx(_data_new.bytes, _dev_count);
 
 			return;
 		}
@@ -27,29 +69,50 @@ class SPI_HC165 : public SPIDeviceInterface
 		{
 			_latch_pin.Init();
 			
-			memset(_data_new, 0x00, sizeof(_data_new));
-			memset(_data_old, 0x00, sizeof(_data_old));
+			memset(&_data_new, 0x00, sizeof(_data_new));
+			memset(_cnt0, 0x00, sizeof(_cnt0));
+			memset(_cnt1, 0x00, sizeof(_cnt1));
+			memset(_cnt2, 0x00, sizeof(_cnt2));
 			
-			_SPI_Run();
+			// Первая выборка принимается как есть, без подавления дребезга. Уже нажатые входы не дают длительного нажатия.
+			if(_SPI_Run() == false) return;
+			_state = _data_new;
+			for(uint8_t w = 0; w < WORDS; ++w)
+			{
+				_long_sent[w] = ~_state.words[w];
+			}
 			for(uint8_t i = 0; i < _dev_count; ++i)
 			{
 				for(uint8_t j = 0; j < 8 ; ++j)
 				{
-					bool n = (_data_new[i] >> j) & 0x01;
-					//bool o = (_data_old[i] >> j) & 0x01;
+					bool n = (_state.bytes[i] >> j) & 0x01;
 					
 					_CallbackRun(i, j, n);
 				}
 			}
+			if(_callback_bulk)
+			{
+				memset(&_changed, 0xFF, sizeof(_changed));
+				_callback_bulk(_changed.bytes, _state.bytes, _dev_count);
+			}
 			
 			return;
 		}
 		
 		virtual void Tick(uint32_t &time) override
 		{
-			if(time - _last_tick > 25)
+			uint32_t elapsed = time - _last_tick;
+			
+			bool run;
+			if(_idle_period == 0 || _busy == true)
+				run = (elapsed > _sample_period);
+			else
+				run = (_trigger == true || elapsed > _idle_period);
+			
+			if(run == true)
 			{
 				_last_tick = time;
+				_trigger = false;
 				
 				Read();
 			}
@@ -57,6 +120,23 @@ class SPI_HC165 : public SPIDeviceInterface
 			return;
 		}
 		
+		/// @brief Включить опрос по изменению входов
+		/// @param idle_period Период страховочного опроса при отсутствии Trigger(), мс, 0 - обычный периодический опрос
+		void SetTriggerMode(uint16_t idle_period)
+		{
+			_idle_period = idle_period;
+			
+			return;
+		}
+		
+		/// @brief Сообщить об изменении входов, можно вызывать из прерывания. Выборка будет сделана в ближайшем Tick()
+		void Trigger()
+		{
+			_trigger = true;
+			
+			return;
+		}
+		
 		void SetCallback(func_change_t callback)
 		{
 			_callback = callback;
@@ -64,29 +144,156 @@ class SPI_HC165 : public SPIDeviceInterface
 			return;
 		}
 		
+		/// @brief Задать обработчик, получающий за один вызов маску изменившихся входов и их состояние.
+		/// Состояние передаётся как есть, активный уровень низкий.
+		void SetBulkCallback(func_bulk_t callback)
+		{
+			_callback_bulk = callback;
+			
+			return;
+		}
+		
+		/// @brief Настроить подавление дребезга
+		/// @param sample_period Период выборки, мс
+		/// @param stable_count Сколько выборок подряд вход должен держать новое состояние, 1..8 (1 - без подавления)
+		/// @param long_press Время удержания для события EVENT_LONG_PRESS, мс, 0 - отключено
+		void SetDebounce(uint16_t sample_period, uint8_t stable_count, uint16_t long_press = 0)
+		{
+			if(stable_count < 1) stable_count = 1;
+			if(stable_count > 8) stable_count = 8;
+			
+			_sample_period = sample_period;
+			_stable_count = stable_count;
+			_long_press = long_press;
+			
+			return;
+		}
+		
 		void Read()
 		{
-			_SPI_Run();
+			if(_SPI_Run() == false) return;
+			Process();
 			
-			if(_callback == nullptr) return;
+			return;
+		}
+		
+		/// @brief Участок приёма выборки для пакета менеджера
+		const SPIManagerInterface::segment_t *BatchSegment() const
+		{
+			return &_batch_segment;
+		}
+		
+		/// @brief Импульс SH/LD перед пакетной выборкой, передаётся в BatchAdd() как before
+		static void BatchLoad(SPIDeviceInterface *device)
+		{
+			static_cast<SPI_HC165 *>(device)->_Load();
 			
-			for(uint8_t i = 0; i < _dev_count; ++i)
+			return;
+		}
+		
+		/// @brief Обработать принятую выборку: вызывается Read() или после завершения пакета
+		void Process()
+		{
+			// Счётчик сравнивается с stable_count - 1: при совпадении и сохранившемся отличии вход переключается.
+			const uint8_t k = _stable_count - 1;
+			const uint32_t k0 = (k & 0x01) ? 0xFFFFFFFF : 0x00000000;
+			const uint32_t k1 = (k & 0x02) ? 0xFFFFFFFF : 0x00000000;
+			const uint32_t k2 = (k & 0x04) ? 0xFFFFFFFF : 0x00000000;
+			
+			uint32_t any = 0;
+			uint32_t counting = 0;
+			for(uint8_t w = 0; w < WORDS; ++w)
 			{
-				if(_data_new[i] == _data_old[i]) continue;
+				uint32_t delta = _data_new.words[w] ^ _state.words[w];
+				uint32_t c0 = _cnt0[w], c1 = _cnt1[w], c2 = _cnt2[w];
 				
-				for(uint8_t j = 0; j < 8 ; ++j)
+				uint32_t changed = delta & ~((c0 ^ k0) | (c1 ^ k1) | (c2 ^ k2));
+				
+				// Инкремент там, где отличие держится, сброс там, где его нет или вход только что переключился.
+				uint32_t keep = delta & ~changed;
+				_cnt2[w] = (c2 ^ (c1 & c0)) & keep;
+				_cnt1[w] = (c1 ^ c0) & keep;
+				_cnt0[w] = ~c0 & keep;
+				counting |= keep;
+				
+				_changed.words[w] = changed;
+				any |= changed;
+				if(changed == 0) continue;
+				_state.words[w] ^= changed;
+				
+				while(changed)
 				{
-					bool n = (_data_new[i] >> j) & 0x01;
-					bool o = (_data_old[i] >> j) & 0x01;
-					if(n == o) continue;
+					uint8_t bit = __builtin_ctz(changed);
+					changed &= changed - 1;
 					
+					uint8_t i = w * 4 + bit / 8;
+					uint8_t j = bit % 8;
+					bool n = (_state.words[w] >> bit) & 0x01;
 					_CallbackRun(i, j, n);
+					
+					// Вход активен низким уровнем.
+					_PushEvent(i, j, (n ? EVENT_RELEASE : EVENT_PRESS));
+					if(n == false)
+					{
+						_press_time[i * 8 + j] = _last_tick;
+						_long_sent[w] &= ~((uint32_t)1 << bit);
+					}
+				}
+			}
+			
+			if(any != 0 && _callback_bulk)
+			{
+				_callback_bulk(_changed.bytes, _state.bytes, _dev_count);
+			}
+			
+			// Пока идёт подсчёт дребезга или ждётся длительное нажатие, опрос нельзя откладывать до Trigger().
+			_busy = (counting != 0);
+			
+			if(_long_press > 0)
+			{
+				for(uint8_t w = 0; w < WORDS; ++w)
+				{
+					uint32_t pressed = ~_state.words[w] & ~_long_sent[w] & _WordMask(w);
+					if(pressed != 0) _busy = true;
+					
+					while(pressed)
+					{
+						uint8_t bit = __builtin_ctz(pressed);
+						pressed &= pressed - 1;
+						
+						uint8_t i = w * 4 + bit / 8;
+						uint8_t j = bit % 8;
+						if((uint16_t)(_last_tick - _press_time[i * 8 + j]) < _long_press) continue;
+						
+						_long_sent[w] |= ((uint32_t)1 << bit);
+						_PushEvent(i, j, EVENT_LONG_PRESS);
+					}
 				}
 			}
 			
 			return;
 		}
 		
+		/// @brief Забрать событие из очереди
+		/// @param event Куда положить событие
+		/// @return true если событие было
+		bool PopEvent(event_t &event)
+		{
+			if(_events_count == 0) return false;
+			
+			event = _events[_events_tail];
+			_events_tail = (_events_tail + 1) % _event_max;
+			_events_count--;
+			
+			return true;
+		}
+		
+		/// @brief Кол-во событий, потерянных из-за переполнения очереди
+		uint16_t GetEventsLost()
+		{
+			return _events_lost;
+		}
+		
 		bool GetState(uint8_t idx)
 		{
 			return GetState((idx / 8), (idx % 8));
@@ -97,7 +304,7 @@ class SPI_HC165 : public SPIDeviceInterface
 			if(device >= _dev_count) return false;
 			if(pin >= 8) return false;
 			
-			return (_data_new[device] >> pin) & 0b00000001;
+			return (_state.bytes[device] >> pin) & 0b00000001;
 		}
 		
 	private:
@@ -112,22 +319,73 @@ class SPI_HC165 : public SPIDeviceInterface
 			return;
 		}
 		
-		void _SPI_Run()
+		// Маска битов слова, соответствующих существующим микросхемам.
+		static inline uint32_t _WordMask(uint8_t w)
+		{
+			uint8_t bytes = _dev_count - w * 4;
+			
+			return (bytes >= 4) ? 0xFFFFFFFF : (((uint32_t)1 << (bytes * 8)) - 1);
+		}
+		
+		void _PushEvent(uint8_t device, uint8_t pin, event_type_t type)
 		{
+			if(_events_count >= _event_max)
+			{
+				_events_lost++;
+				
+				return;
+			}
+			
+			_events[(_events_tail + _events_count) % _event_max] = {device, pin, type};
+			_events_count++;
+			
+			return;
+		}
+		
+		void _Load()
+		{
+			// SH/LD должен держаться низким не меньше ~100 нс (74HC165 при 2 В), как RCLK у SPI_HC595.
 			_latch_pin.Off();
-			memcpy(_data_old, _data_new, sizeof(_data_old));
+			asm("nop\n nop\n");
 			_latch_pin.On();
-
-			DeviceActivate();
-			_spi_interface->ReceiveData(_data_new, sizeof(_data_new));
-			DeviceDeactivate();
 			
 			return;
 		}
 		
+		/// @return false если шина занята, выборки нет
+		bool _SPI_Run()
+		{
+			_Load();
+
+			if(DeviceActivate<_manager_t>() == false) return false;
+			DeviceManager<_manager_t>()->ReceiveData(_data_new.bytes, _dev_count);
+			DeviceDeactivate<_manager_t>();
+			
+			return true;
+		}
+		
 		DrakePinD _latch_pin;
-		uint8_t _data_new[_dev_count];
-		uint8_t _data_old[_dev_count];
+		buffer_t _data_new;							// Сырая выборка
+		buffer_t _state;							// Состояние после подавления дребезга
+		buffer_t _changed;							// Входы, изменившиеся в последней выборке
+		SPIManagerInterface::segment_t _batch_segment;
+		uint32_t _cnt0[WORDS];						// Вертикальный счётчик, бит 0
+		uint32_t _cnt1[WORDS];						// Вертикальный счётчик, бит 1
+		uint32_t _cnt2[WORDS];						// Вертикальный счётчик, бит 2
+		uint32_t _long_sent[WORDS];					// Событие длительного нажатия уже отправлено
+		uint16_t _press_time[_dev_count * 8];		// Время нажатия, младшие 16 бит
 		uint32_t _last_tick = 0;
+		uint16_t _sample_period = 25;
+		uint16_t _idle_period = 0;
+		volatile bool _trigger = false;
+		bool _busy = false;
+		uint8_t _stable_count = 1;
+		uint16_t _long_press = 0;
 		func_change_t _callback = nullptr;
+		func_bulk_t _callback_bulk = nullptr;
+		
+		event_t _events[_event_max];
+		uint8_t _events_tail = 0;
+		uint8_t _events_count = 0;
+		uint16_t _events_lost = 0;
 };
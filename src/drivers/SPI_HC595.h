@@ -5,19 +5,38 @@
 #include <DrakePinD.hpp>
 
 /*
+	Выходы цепочки 74HC595.
 
+	Передачу можно включить в пакет менеджера: BatchAdd(hc595, hc595.BatchSegment(), 1, nullptr, hc595.BatchLatch).
+	Буфер не должен меняться до завершения пакета.
+	
+	_manager_t - тип менеджера шины: с SPIStaticManager передача идёт без виртуальных вызовов (см. SPIStaticManager.h).
 */
 
-template <uint8_t _dev_count> 
+template <uint8_t _dev_count, uint8_t _pattern_max = 8, typename _manager_t = SPIManagerInterface> 
 class SPI_HC595 : public SPIDeviceInterface
 {
+	static constexpr uint8_t PATTERN_FREE = 0xFF;
+	
+	// Мигание выхода: период on_time + off_time, отсчёт от start со сдвигом phase.
+	struct pattern_t
+	{
+		uint8_t idx = PATTERN_FREE;	// Номер выхода, PATTERN_FREE если слот свободен
+		bool end_state = false;		// Состояние выхода после окончания повторов
+		uint16_t on_time = 0;		// Время включения, мс
+		uint16_t off_time = 0;		// Время выключения, мс
+		uint16_t phase = 0;			// Сдвиг фазы, мс
+		uint16_t repeat = 0;		// Кол-во периодов, 0 - бесконечно
+		uint32_t start = 0;			// Время запуска
+	};
+	
 	public:
 		SPI_HC595(const DrakePin::PinD_t &cs_pin, const DrakePin::PinD_t &latch_pin, const DrakePin::PinD_t &oe_pin, uint32_t spi_prescaler) : 
 			SPIDeviceInterface(cs_pin, spi_prescaler), 
 			_latch_pin(latch_pin, DrakePin::Output, DrakePin::Low), 
 			_oe_pin(oe_pin, DrakePin::Output, DrakePin::High)
 		{
-
+			_batch_segment = SPIManagerInterface::Tx(_data, _dev_count);
 		}
 		
 		virtual void Init() override
@@ -32,6 +51,74 @@ class SPI_HC595 : public SPIDeviceInterface
 		
 		virtual void Tick(uint32_t &time) override
 		{
+			// Все выходы, сменившие состояние за этот вызов, уходят одной передачей.
+			BeginUpdate();
+			_TickPatterns(time);
+			Commit();
+			
+			return;
+		}
+		
+		/// @brief Запустить мигание выхода, вычисляется в Tick()
+		/// @param idx Номер выхода
+		/// @param on_time Время включения, мс
+		/// @param off_time Время выключения, мс
+		/// @param repeat Кол-во периодов, 0 - бесконечно
+		/// @param phase Сдвиг фазы, мс. Выходы с одинаковым периодом, запущенные в одном Tick(), мигают синхронно
+		/// @param end_state Состояние выхода после окончания повторов
+		/// @return true в случае успеха, false если нет свободного слота
+		bool SetPattern(uint8_t idx, uint16_t on_time, uint16_t off_time, uint16_t repeat = 0, uint16_t phase = 0, bool end_state = false)
+		{
+			if(idx >= (_dev_count * 8)) return false;
+			
+			pattern_t *slot = nullptr;
+			for(pattern_t &pattern : _patterns)
+			{
+				if(pattern.idx == idx)
+				{
+					slot = &pattern;
+					break;
+				}
+				if(pattern.idx == PATTERN_FREE && slot == nullptr)
+				{
+					slot = &pattern;
+				}
+			}
+			if(slot == nullptr) return false;
+			
+			slot->idx = idx;
+			slot->end_state = end_state;
+			slot->on_time = on_time;
+			slot->off_time = off_time;
+			slot->phase = phase;
+			slot->repeat = repeat;
+			slot->start = _time;
+			
+			return true;
+		}
+		
+		/// @brief Однократно включить выход на указанное время
+		/// @param idx Номер выхода
+		/// @param duration Длительность импульса, мс
+		/// @return true в случае успеха, false если нет свободного слота
+		bool SetPulse(uint8_t idx, uint16_t duration)
+		{
+			return SetPattern(idx, duration, 0, 1, 0, false);
+		}
+		
+		/// @brief Остановить мигание выхода
+		/// @param idx Номер выхода
+		/// @param state Состояние, в котором оставить выход
+		void StopPattern(uint8_t idx, bool state = false)
+		{
+			for(pattern_t &pattern : _patterns)
+			{
+				if(pattern.idx != idx) continue;
+				
+				pattern.idx = PATTERN_FREE;
+				SetState(idx, state);
+			}
+			
 			return;
 		}
 		
@@ -49,28 +136,29 @@ class SPI_HC595 : public SPIDeviceInterface
 			return;
 		}
 		
-		void SetState(uint8_t idx, bool state)
+		// Виртуальные, чтобы вызовы через ссылку на SPI_HC595 доходили до наследника (например, SPI_HC595_BAM).
+		virtual void SetState(uint8_t idx, bool state)
 		{
 			return SetState((idx / 8), (idx % 8), state);
 		}
 		
-		void SetState(uint8_t device, uint8_t pin, bool state)
+		virtual void SetState(uint8_t device, uint8_t pin, bool state)
 		{
 			if(device >= _dev_count) return;
 			if(pin >= 8) return;
 			
 			_data[device] = (_data[device] & ~(1 << pin)) | (state << pin);
-			_SPI_Run();
+			_Update();
 			
 			return;
 		}
 		
-		bool GetState(uint8_t idx)
+		virtual bool GetState(uint8_t idx)
 		{
 			return GetState((idx / 8), (idx % 8));
 		}
 		
-		bool GetState(uint8_t device, uint8_t pin)
+		virtual bool GetState(uint8_t device, uint8_t pin)
 		{
 			if(device >= _dev_count) return false;
 			if(pin >= 8) return false;
@@ -78,34 +166,119 @@ class SPI_HC595 : public SPIDeviceInterface
 			return (_data[device] >> pin) & 0b00000001;
 		}
 		
-		void WriteByte(uint8_t device, const uint8_t byte)
+		virtual void WriteByte(uint8_t device, const uint8_t byte)
 		{
 			if(device >= _dev_count) return;
 			
 			_data[device] = byte;
-			_SPI_Run();
+			_Update();
 			
 			return;
 		}
 		
-		void WriteByMask(uint8_t device, const uint8_t byte, const uint8_t mask)
+		virtual void WriteByMask(uint8_t device, const uint8_t byte, const uint8_t mask)
 		{
 			if(device >= _dev_count) return;
 			
 			_data[device] = (_data[device] & ~mask) | (byte & mask);
-			_SPI_Run();
+			_Update();
+			
+			return;
+		}
+		
+		/// @brief Начать пакетное изменение выходов: SetState, WriteByte и WriteByMask
+		/// только меняют буфер, а в регистры он уходит одной передачей в Commit(). Вызовы могут быть вложенными.
+		void BeginUpdate()
+		{
+			++_update_depth;
+			
+			return;
+		}
+		
+		/// @brief Завершить пакетное изменение и отправить буфер, если он отличается от защёлкнутого
+		void Commit()
+		{
+			if(_update_depth > 0) --_update_depth;
+			_Update();
 			
 			return;
 		}
 		
-	private:
+		/// @brief Участок передачи буфера для пакета менеджера
+		const SPIManagerInterface::segment_t *BatchSegment() const
+		{
+			return &_batch_segment;
+		}
+		
+		/// @brief Защёлка RCLK после пакетной передачи, передаётся в BatchAdd() как after
+		static void BatchLatch(SPIDeviceInterface *device)
+		{
+			SPI_HC595 *self = static_cast<SPI_HC595 *>(device);
+			self->_Latch();
+			memcpy(self->_data_latched, self->_data, sizeof(self->_data_latched));
+			
+			return;
+		}
+	
+	protected:
+		
+		/// @brief Шаг мигания. Выходы меняются через SetState(), так что наследник со своим буфером (SPI_HC595_BAM) получает их так же.
+		void _TickPatterns(uint32_t time)
+		{
+			_time = time;
+			
+			for(pattern_t &pattern : _patterns)
+			{
+				if(pattern.idx == PATTERN_FREE) continue;
+				
+				uint32_t period = (uint32_t)pattern.on_time + pattern.off_time;
+				uint32_t elapsed = time - pattern.start;
+				if(period == 0 || (pattern.repeat > 0 && elapsed >= period * pattern.repeat))
+				{
+					SetState(pattern.idx, pattern.end_state);
+					pattern.idx = PATTERN_FREE;
+					
+					continue;
+				}
+				
+				SetState(pattern.idx, ((elapsed + pattern.phase) % period) < pattern.on_time);
+			}
+			
+			return;
+		}
+		
+		void _Update()
+		{
+			if(_update_depth > 0) return;
+			if(memcmp(_data, _data_latched, sizeof(_data)) == 0) return;
+			
+			_SPI_Run();
+			
+			return;
+		}
 		
 		void _SPI_Run()
 		{
-			DeviceActivate();
-			_spi_interface->TransmitData(_data, sizeof(_data));
-			DeviceDeactivate();
+			// Не ушедшие из-за занятой шины данные остаются отличными от _data_latched и уйдут при следующем _Update().
+			if(_SPI_Shift(_data) == false) return;
+			memcpy(_data_latched, _data, sizeof(_data_latched));
+			
+			return;
+		}
+		
+		/// @return false если шина занята, выходы не менялись
+		bool _SPI_Shift(uint8_t *data)
+		{
+			if(DeviceActivate<_manager_t>() == false) return false;
+			DeviceManager<_manager_t>()->TransmitData(data, _dev_count);
+			DeviceDeactivate<_manager_t>();
+			_Latch();
 			
+			return true;
+		}
+		
+		void _Latch()
+		{
 			_latch_pin.On();
 			asm("nop\n nop\n");
 			_latch_pin.Off();
@@ -116,4 +289,10 @@ class SPI_HC595 : public SPIDeviceInterface
 		DrakePinD _latch_pin;
 		DrakePinD _oe_pin;
 		uint8_t _data[_dev_count];
+		uint8_t _data_latched[_dev_count];
+		uint8_t _update_depth = 0;
+		SPIManagerInterface::segment_t _batch_segment;
+		
+		pattern_t _patterns[_pattern_max];
+		uint32_t _time = 0;
 };
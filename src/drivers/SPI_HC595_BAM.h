@@ -0,0 +1,204 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include "SPI_HC595.h"
+
+/*
+	Яркость выходов цепочки 74HC595 методом Bit Angle Modulation.
+	Каждому выходу задаётся 8-битная скважность, из неё строятся 8 битовых плоскостей на всю цепочку.
+	Плоскость N держится на выходах 2^N базовых периодов таймера, поэтому кадр это 8 передач вместо 256.
+	
+	Refresh() вызывается из прерывания таймера, выставляет следующую плоскость и возвращает её вес:
+	таймер перезаряжается на (базовый период * вес). Для таймера с постоянным периодом есть RefreshTick().
+	Если шина занята, плоскость не передаётся, а Refresh() возвращает 1 и выставит её при следующем вызове.
+	С SPI_BUS_LOCK_FREERTOS прерывание захватывает шину только при свободном мьютексе (см. SPIBusLock.h),
+	так что пока шину держит задача, кадр стоит на текущей плоскости.
+	Пересчёт плоскостей после SetDuty() выполняется в Tick(), подмена буфера - в начале следующего кадра.
+	SetPattern() / SetPulse() работают как у SPI_HC595: мигание вычисляется в Tick() и задаёт скважность 0 или 255.
+	Буфер SPI_HC595 здесь не используется, поэтому BeginUpdate() / Commit() и пакет (BatchSegment() / BatchLatch())
+	недоступны: они передали бы его поверх текущей плоскости.
+	Refresh() - горячий путь в прерывании, поэтому с SPIStaticManager стоит передать его тип в _manager_t.
+*/
+
+template <uint8_t _dev_count, typename _manager_t = SPIManagerInterface, uint8_t _pattern_max = 8> 
+class SPI_HC595_BAM : public SPI_HC595<_dev_count, _pattern_max, _manager_t>
+{
+	static constexpr uint8_t BAM_BITS = 8;
+	
+	public:
+		
+		SPI_HC595_BAM(const DrakePin::PinD_t &cs_pin, const DrakePin::PinD_t &latch_pin, const DrakePin::PinD_t &oe_pin, uint32_t spi_prescaler) : 
+			SPI_HC595<_dev_count, _pattern_max, _manager_t>(cs_pin, latch_pin, oe_pin, spi_prescaler)
+		{
+
+		}
+		
+		virtual void Init() override
+		{
+			SPI_HC595<_dev_count, _pattern_max, _manager_t>::Init();
+			
+			memset(_duty, 0x00, sizeof(_duty));
+			memset(_planes, 0x00, sizeof(_planes));
+			
+			return;
+		}
+		
+		virtual void Tick(uint32_t &time) override
+		{
+			this->_TickPatterns(time);
+			
+			if(_dirty == true && _swap_pending == false)
+			{
+				_dirty = false;
+				_BuildPlanes(_planes[_front ^ 1]);
+				_swap_pending = true;
+			}
+			
+			return;
+		}
+		
+		/// @brief Выставить следующую битовую плоскость, вызывается из прерывания таймера
+		/// @return Вес выставленной плоскости: через сколько базовых периодов вызвать Refresh() снова
+		uint8_t Refresh()
+		{
+			if(_plane == 0 && _swap_pending == true)
+			{
+				_front ^= 1;
+				_swap_pending = false;
+			}
+			
+			// Шина занята: плоскость не выставлена, повторяем её через один базовый период.
+			if(this->_SPI_Shift(_planes[_front][_plane]) == false) return 1;
+			
+			uint8_t weight = (1 << _plane);
+			_plane = (_plane + 1) % BAM_BITS;
+			
+			return weight;
+		}
+		
+		/// @brief Вариант Refresh() для таймера с постоянным периодом: передача идёт только на смене плоскости
+		void RefreshTick()
+		{
+			if(_countdown > 1)
+			{
+				--_countdown;
+				
+				return;
+			}
+			
+			_countdown = Refresh();
+			
+			return;
+		}
+		
+		void SetDuty(uint8_t idx, uint8_t duty)
+		{
+			if(idx >= (_dev_count * 8)) return;
+			
+			_duty[idx] = duty;
+			_dirty = true;
+			
+			return;
+		}
+		
+		void SetDuty(uint8_t device, uint8_t pin, uint8_t duty)
+		{
+			if(device >= _dev_count) return;
+			if(pin >= 8) return;
+			
+			return SetDuty((device * 8 + pin), duty);
+		}
+		
+		uint8_t GetDuty(uint8_t idx)
+		{
+			if(idx >= (_dev_count * 8)) return 0;
+			
+			return _duty[idx];
+		}
+		
+		uint8_t GetDuty(uint8_t device, uint8_t pin)
+		{
+			if(device >= _dev_count) return 0;
+			if(pin >= 8) return 0;
+			
+			return _duty[device * 8 + pin];
+		}
+		
+		// Дискретное управление выходами в режиме BAM сводится к скважности 0 или 255.
+		
+		virtual void SetState(uint8_t idx, bool state) override
+		{
+			return SetDuty(idx, (state ? 0xFF : 0x00));
+		}
+		
+		virtual void SetState(uint8_t device, uint8_t pin, bool state) override
+		{
+			return SetDuty(device, pin, (state ? 0xFF : 0x00));
+		}
+		
+		virtual bool GetState(uint8_t idx) override
+		{
+			return GetDuty(idx) != 0;
+		}
+		
+		virtual bool GetState(uint8_t device, uint8_t pin) override
+		{
+			return GetDuty(device, pin) != 0;
+		}
+		
+		virtual void WriteByte(uint8_t device, const uint8_t byte) override
+		{
+			return WriteByMask(device, byte, 0xFF);
+		}
+		
+		virtual void WriteByMask(uint8_t device, const uint8_t byte, const uint8_t mask) override
+		{
+			if(device >= _dev_count) return;
+			
+			for(uint8_t pin = 0; pin < 8; ++pin)
+			{
+				if(mask & (1 << pin))
+				{
+					_duty[device * 8 + pin] = (byte & (1 << pin)) ? 0xFF : 0x00;
+				}
+			}
+			_dirty = true;
+			
+			return;
+		}
+		
+		void BeginUpdate() = delete;
+		void Commit() = delete;
+		const SPIManagerInterface::segment_t *BatchSegment() const = delete;
+		static void BatchLatch(SPIDeviceInterface *device) = delete;
+	
+	private:
+		
+		void _BuildPlanes(uint8_t (&planes)[BAM_BITS][_dev_count])
+		{
+			for(uint8_t device = 0; device < _dev_count; ++device)
+			{
+				const uint8_t *duty = &_duty[device * 8];
+				for(uint8_t bit = 0; bit < BAM_BITS; ++bit)
+				{
+					uint8_t plane = 0;
+					for(uint8_t pin = 0; pin < 8; ++pin)
+					{
+						plane |= ((duty[pin] >> bit) & 0x01) << pin;
+					}
+					planes[bit][device] = plane;
+				}
+			}
+			
+			return;
+		}
+		
+		uint8_t _duty[_dev_count * 8];
+		uint8_t _planes[2][BAM_BITS][_dev_count];
+		
+		volatile uint8_t _front = 0;
+		volatile bool _swap_pending = false;
+		bool _dirty = false;
+		uint8_t _plane = 0;
+		uint8_t _countdown = 0;
+};
@@ -0,0 +1,229 @@
+#pragma once
+#include <inttypes.h>
+#include <string.h>
+#include <SPIManager.h>
+#include <DrakePinD.hpp>
+
+/*
+	Цепочки 74HC595 (выходы) и 74HC165 (входы) на общем SCK, обновляемые одной полнодуплексной передачей:
+	MOSI задвигает выходы, MISO одновременно выдвигает входы.
+	
+	Порядок опроса: импульс SH/LD защёлкивает входы 165, затем TransmitReceive на длину большей из цепочек,
+	затем импульс RCLK переносит задвинутые данные на выходы 595.
+	Если цепочка выходов короче, перед её данными идут байты-заполнители, которые выдвигаются за её пределы.
+	Если короче цепочка входов, лишние принятые байты отбрасываются.
+*/
+
+template <uint8_t _out_count, uint8_t _in_count> 
+class SPI_HC595_HC165 : public SPIDeviceInterface
+{
+	using func_change_t = void (*)(uint8_t device, uint8_t pin, bool state);
+	
+	static constexpr uint8_t LENGTH = (_out_count > _in_count) ? _out_count : _in_count;
+	static constexpr uint8_t OUT_OFFSET = LENGTH - _out_count;
+	
+	public:
+		
+		SPI_HC595_HC165(const DrakePin::PinD_t &cs_pin, const DrakePin::PinD_t &out_latch_pin, const DrakePin::PinD_t &oe_pin, const DrakePin::PinD_t &in_latch_pin, uint32_t spi_prescaler) : 
+			SPIDeviceInterface(cs_pin, spi_prescaler), 
+			_out_latch_pin(out_latch_pin, DrakePin::Output, DrakePin::Low), 
+			_oe_pin(oe_pin, DrakePin::Output, DrakePin::High), 
+			_in_latch_pin(in_latch_pin, DrakePin::Output, DrakePin::High)
+		{
+
+		}
+		
+		virtual void Init() override
+		{
+			_out_latch_pin.Init();
+			_oe_pin.Init();
+			_in_latch_pin.Init();
+			
+			memset(_tx, 0x00, sizeof(_tx));
+			memset(_rx, 0x00, sizeof(_rx));
+			
+			// Первая выборка принимается как есть, все входы сообщаются обработчику.
+			if(_SPI_Run() == false) return;
+			memcpy(_in_state, _rx, sizeof(_in_state));
+			for(uint8_t i = 0; i < _in_count; ++i)
+			{
+				for(uint8_t j = 0; j < 8 ; ++j)
+				{
+					_CallbackRun(i, j, ((_in_state[i] >> j) & 0x01));
+				}
+			}
+			
+			return;
+		}
+		
+		virtual void Tick(uint32_t &time) override
+		{
+			if(time - _last_tick > _scan_period || _dirty == true)
+			{
+				_last_tick = time;
+				
+				Scan();
+			}
+			
+			return;
+		}
+		
+		/// @brief Задать период опроса входов. Изменённые выходы уходят в ближайшем Tick() независимо от периода
+		/// @param scan_period Период, мс
+		void SetScanPeriod(uint16_t scan_period)
+		{
+			_scan_period = scan_period;
+			
+			return;
+		}
+		
+		void SetCallback(func_change_t callback)
+		{
+			_callback = callback;
+			
+			return;
+		}
+		
+		/// @brief Выполнить полный цикл обмена: выставить выходы и прочитать входы
+		void Scan()
+		{
+			if(_SPI_Run() == false) return;
+			
+			for(uint8_t i = 0; i < _in_count; ++i)
+			{
+				uint8_t changed = _rx[i] ^ _in_state[i];
+				if(changed == 0) continue;
+				_in_state[i] = _rx[i];
+				
+				for(uint8_t j = 0; j < 8 ; ++j)
+				{
+					if((changed & (1 << j)) == 0) continue;
+					
+					_CallbackRun(i, j, ((_in_state[i] >> j) & 0x01));
+				}
+			}
+			
+			return;
+		}
+		
+		void OutputEnable()
+		{
+			_oe_pin.Off();
+			
+			return;
+		}
+		
+		void OutputDisable()
+		{
+			_oe_pin.On();
+			
+			return;
+		}
+		
+		void SetState(uint8_t idx, bool state)
+		{
+			return SetState((idx / 8), (idx % 8), state);
+		}
+		
+		void SetState(uint8_t device, uint8_t pin, bool state)
+		{
+			if(device >= _out_count) return;
+			if(pin >= 8) return;
+			
+			return WriteByMask(device, (state << pin), (1 << pin));
+		}
+		
+		bool GetState(uint8_t idx)
+		{
+			return GetState((idx / 8), (idx % 8));
+		}
+		
+		bool GetState(uint8_t device, uint8_t pin)
+		{
+			if(device >= _out_count) return false;
+			if(pin >= 8) return false;
+			
+			return (_tx[OUT_OFFSET + device] >> pin) & 0b00000001;
+		}
+		
+		void WriteByte(uint8_t device, const uint8_t byte)
+		{
+			return WriteByMask(device, byte, 0xFF);
+		}
+		
+		void WriteByMask(uint8_t device, const uint8_t byte, const uint8_t mask)
+		{
+			if(device >= _out_count) return;
+			
+			uint8_t &data = _tx[OUT_OFFSET + device];
+			uint8_t value = (data & ~mask) | (byte & mask);
+			if(value == data) return;
+			
+			data = value;
+			_dirty = true;
+			
+			return;
+		}
+		
+		bool GetInput(uint8_t idx)
+		{
+			return GetInput((idx / 8), (idx % 8));
+		}
+		
+		bool GetInput(uint8_t device, uint8_t pin)
+		{
+			if(device >= _in_count) return false;
+			if(pin >= 8) return false;
+			
+			return (_in_state[device] >> pin) & 0b00000001;
+		}
+		
+	private:
+		
+		inline void _CallbackRun(uint8_t device, uint8_t pin, bool state)
+		{
+			if(_callback)
+			{
+				_callback(device, pin, !state);
+			}
+			
+			return;
+		}
+		
+		/// @return false если шина занята: выходы остаются грязными, входы не прочитаны
+		bool _SPI_Run()
+		{
+			_in_latch_pin.Off();
+			_in_latch_pin.On();
+			
+			// Флаг снимается до передачи: SetState() во время неё снова взведёт его, и изменение уйдёт следующим опросом.
+			_dirty = false;
+			if(DeviceActivate() == false)
+			{
+				_dirty = true;
+				
+				return false;
+			}
+			_spi_interface->TransmitReceive(_tx, _rx, LENGTH);
+			DeviceDeactivate();
+			
+			_out_latch_pin.On();
+			asm("nop\n nop\n");
+			_out_latch_pin.Off();
+			
+			return true;
+		}
+		
+		DrakePinD _out_latch_pin;
+		DrakePinD _oe_pin;
+		DrakePinD _in_latch_pin;
+		
+		uint8_t _tx[LENGTH];						// Заполнители + образ выходов
+		uint8_t _rx[LENGTH];						// Сырая выборка входов
+		uint8_t _in_state[_in_count];				// Состояние входов на последнем опросе
+		
+		uint32_t _last_tick = 0;
+		uint16_t _scan_period = 25;
+		volatile bool _dirty = false;
+		func_change_t _callback = nullptr;
+};
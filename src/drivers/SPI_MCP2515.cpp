@@ -8,6 +8,7 @@
 #define REG_BFPCTRL                0x0C
 #define REG_TXRTSCTRL              0x0D
 
+#define REG_CANSTAT                0x0E
 #define REG_CANCTRL                0x0F
 
 #define REG_CNF3                   0x28
@@ -17,14 +18,25 @@
 #define REG_CANINTE                0x2B
 #define REG_CANINTF                0x2C
 
+#define REG_TEC                    0x1C
+#define REG_REC                    0x1D
+#define REG_EFLG                   0x2D
+
+#define FLAG_EFLG_RXnOVR(n)        (0x40 << n)
+#define FLAG_EFLG_TXBO             0x20
+#define FLAG_EFLG_TXEP             0x10
+#define FLAG_EFLG_RXEP             0x08
+#define FLAG_EFLG_EWARN            0x01
+
 #define FLAG_RXnIE(n)              (0x01 << n)
 #define FLAG_RXnIF(n)              (0x01 << n)
 #define FLAG_TXnIF(n)              (0x04 << n)
 
-#define REG_RXFnSIDH(n)            (0x00 + (n * 4))
-#define REG_RXFnSIDL(n)            (0x01 + (n * 4))
-#define REG_RXFnEID8(n)            (0x02 + (n * 4))
-#define REG_RXFnEID0(n)            (0x03 + (n * 4))
+// RXF0..RXF2 лежат с 0x00, RXF3..RXF5 с 0x10 (между ними BFPCTRL..CANCTRL)
+#define REG_RXFnSIDH(n)            (0x00 + (n * 4) + ((n >= 3) ? 4 : 0))
+#define REG_RXFnSIDL(n)            (0x01 + (n * 4) + ((n >= 3) ? 4 : 0))
+#define REG_RXFnEID8(n)            (0x02 + (n * 4) + ((n >= 3) ? 4 : 0))
+#define REG_RXFnEID0(n)            (0x03 + (n * 4) + ((n >= 3) ? 4 : 0))
 
 #define REG_RXMnSIDH(n)            (0x20 + (n * 0x04))
 #define REG_RXMnSIDL(n)            (0x21 + (n * 0x04))
@@ -54,42 +66,29 @@
 
 #define FLAG_RXM0                  0x20
 #define FLAG_RXM1                  0x40
+#define FLAG_BUKT                  0x04
 
+#define CMD_READ_RX_BUFFER(n)      (0x90 | (n << 2))
+#define CMD_READ_STATUS            0xA0
+#define CMD_RX_STATUS              0xB0
 
-const SPI_MCP2515::cnf_f SPI_MCP2515::_cnf_map[26] = 
-{
-	{  8000000, 1000000, {0x00, 0x80, 0x00} },
-	{  8000000,  666666, {0xC0, 0xB8, 0x01} },
-	{  8000000,  500000, {0x00, 0x90, 0x02} },
-	{  8000000,  250000, {0x00, 0xB1, 0x05} },
-	{  8000000,  200000, {0x00, 0xB4, 0x06} },
-	{  8000000,  125000, {0x01, 0xB1, 0x05} },
-	{  8000000,  100000, {0x01, 0xB4, 0x06} },
-	{  8000000,   80000, {0x01, 0xBF, 0x07} },
-	{  8000000,   50000, {0x03, 0xB4, 0x06} },
-	{  8000000,   40000, {0x03, 0xBF, 0x07} },
-	{  8000000,   20000, {0x07, 0xBF, 0x07} },
-	{  8000000,   10000, {0x0F, 0xBF, 0x07} },
-	{  8000000,    5000, {0x1F, 0xBF, 0x07} },
-
-	{ 16000000, 1000000, {0x00, 0xD0, 0x82} },
-	{ 16000000,  666666, {0xC0, 0xF8, 0x81} },
-	{ 16000000,  500000, {0x00, 0xF0, 0x86} },
-	{ 16000000,  250000, {0x41, 0xF1, 0x85} },
-	{ 16000000,  200000, {0x01, 0xFA, 0x87} },
-	{ 16000000,  125000, {0x03, 0xF0, 0x86} },
-	{ 16000000,  100000, {0x03, 0xFA, 0x87} },
-	{ 16000000,   80000, {0x03, 0xFF, 0x87} },
-	{ 16000000,   50000, {0x07, 0xFA, 0x87} },
-	{ 16000000,   40000, {0x07, 0xFF, 0x87} },
-	{ 16000000,   20000, {0x0F, 0xFF, 0x87} },
-	{ 16000000,   10000, {0x1F, 0xFF, 0x87} },
-	{ 16000000,    5000, {0x3F, 0xFF, 0x87} },
-};
+#define FLAG_STATUS_TXnREQ(n)      (0x04 << (n * 2))
+#define FLAG_RXSTATUS_RXB(n)       (0x40 << n)
+#define MASK_RXSTATUS_FILTER       0x07
+
+#define MASK_ID_STD                0x1FFC0000
+#define MASK_ID_EXT                0x1FFFFFFF
 
 
 bool SPI_MCP2515::begin(uint32_t clock_frequency, uint32_t baud_rate, func_rx_t callback)
 {
+	return begin(bitTiming(clock_frequency, baud_rate), callback);
+}
+
+bool SPI_MCP2515::begin(const bit_timing_t &timing, func_rx_t callback)
+{
+	if(timing.valid == false) return false;
+	
 	// Нет необходимости чистить всё полностью. Этого достаточно
 	_rx.flag = false;
 	_rx.id = NO_CAN_ID;
@@ -97,26 +96,20 @@ bool SPI_MCP2515::begin(uint32_t clock_frequency, uint32_t baud_rate, func_rx_t
 	_tx.id = NO_CAN_ID;
 	
 	_onReceive = callback;
+	_timing = timing;
+	_filter_soft = false;
+	_filter_mode = FILTER_NONE;
+	memset(&_errors, 0x00, sizeof(_errors));
+	_recover_delay = RECOVER_DELAY_MIN;
+	_opmode = 0x00;
 	
 	cmd_reset();
 
 	if( writeReadRegister(REG_CANCTRL, 0x80) == false ) return false;
 	
-	const uint8_t *cnf = nullptr;
-	for(uint8_t i = 0; i < (sizeof(_cnf_map) / sizeof(_cnf_map[0])); ++i)
-	{
-		if(_cnf_map[i].clockFrequency == clock_frequency && _cnf_map[i].baudRate == baud_rate)
-		{
-			cnf = _cnf_map[i].cnf;
-			break;
-		}
-	}
-	
-	if(cnf == nullptr) return false;
-	
-	writeRegister(REG_CNF1, cnf[0]);
-	writeRegister(REG_CNF2, cnf[1]);
-	writeRegister(REG_CNF3, cnf[2]);
+	writeRegister(REG_CNF1, timing.cnf[0]);
+	writeRegister(REG_CNF2, timing.cnf[1]);
+	writeRegister(REG_CNF3, timing.cnf[2]);
 	
 	writeRegister(REG_CANINTE, FLAG_RXnIE(1) | FLAG_RXnIE(0));
 	writeRegister(REG_BFPCTRL, 0x00);
@@ -131,6 +124,10 @@ bool SPI_MCP2515::begin(uint32_t clock_frequency, uint32_t baud_rate, func_rx_t
 
 void SPI_MCP2515::end()
 {
+	// Режим конфигурации отключает чип от шины, регистры при этом сохраняются.
+	writeRegister(REG_CANCTRL, 0x80);
+	_timing.valid = false;
+	
 	return;
 }
 
@@ -145,13 +142,58 @@ void SPI_MCP2515::Init()
 	return;
 }
 
+SPIDeviceInterface::probe_t SPI_MCP2515::DeviceProbe()
+{
+	// До begin() чип в режиме конфигурации (после сброса CANSTAT = 0x80), и CNF1 можно писать: ответ - два
+	// записанных и прочитанных обратно узора, которых не даст линия MISO, висящая в 0 или 1. CNF1 восстанавливается.
+	if(_timing.valid == false)
+	{
+		uint8_t canstat;
+		if(readRegister(REG_CANSTAT, canstat) == false) return PROBE_FAIL;
+		if((canstat & 0xE0) != 0x80) return PROBE_NONE;
+		
+		uint8_t cnf1;
+		if(readRegister(REG_CNF1, cnf1) == false) return PROBE_FAIL;
+		
+		bool result = (writeReadRegister(REG_CNF1, 0x5A) == true && writeReadRegister(REG_CNF1, 0xA5) == true);
+		writeRegister(REG_CNF1, cnf1);
+		
+		return (result == true) ? PROBE_OK : PROBE_FAIL;
+	}
+	
+	// CNF меняются только в режиме конфигурации, так что после begin() это известный ответ без записи в чип.
+	// Регистры идут подряд: CNF3, CNF2, CNF1. Биты 5..3 CNF3 не реализованы и читаются нулями.
+	uint8_t cnf[3];
+	if(readRegisters(REG_CNF3, cnf, sizeof(cnf)) == false) return PROBE_FAIL;
+	if((cnf[0] & 0xC7) != (_timing.cnf[2] & 0xC7) || cnf[1] != _timing.cnf[1] || cnf[2] != _timing.cnf[0]) return PROBE_FAIL;
+	
+	return PROBE_OK;
+}
+
 void SPI_MCP2515::Tick(uint32_t &time)
 {
-	if(_int_pin.Read() == DrakePin::Low)
+	if(_timing.valid == true && _error_interval > 0 && time - _error_last >= _error_interval)
 	{
-		if(readRegister(REG_CANINTF) == 0) return;
+		_error_last = time;
 		
-		while(parsePacket() || _rx.id != NO_CAN_ID)
+		checkErrors(time);
+	}
+	
+	// Линия INT снимается чипом сама, как только оба приёмных буфера прочитаны,
+	// поэтому на каждый пакет приходится один опрос RX STATUS и одно пакетное чтение.
+	while(_int_pin.Read() == DrakePin::Low)
+	{
+		if(parsePacket() == 0 && _rx.id == NO_CAN_ID) break;
+		
+		if(_filter_soft == true && filterMatch(_rx.id, _rx.extended) == false)
+		{
+			++_filter_dropped;
+			continue;
+		}
+		
+		if(_dispatcher != nullptr && _dispatcher->Dispatch(_rx.id, _rx.extended, _rx.data, _rx.length) == true) continue;
+		
+		if(_onReceive != nullptr)
 		{
 			_onReceive(_rx.id, _rx.data, _rx.length);
 		}
@@ -240,7 +282,7 @@ bool SPI_MCP2515::endPacket()
 	writeRegister(REG_TXBnCTRL(n), 0x08);
 	
 	bool aborted = false;
-	while(readRegister(REG_TXBnCTRL(n)) & 0x08)
+	while(readStatus() & FLAG_STATUS_TXnREQ(n))
 	{
 		if(readRegister(REG_TXBnCTRL(n)) & 0x10)
 		{
@@ -257,7 +299,10 @@ bool SPI_MCP2515::endPacket()
 	
 	modifyRegister(REG_CANINTF, FLAG_TXnIF(n), 0x00);
 	
-	return ((readRegister(REG_TXBnCTRL(n)) & 0x70) ? false : true);
+	uint8_t ctrl;
+	if(readRegister(REG_TXBnCTRL(n), ctrl) == false) return false;
+	
+	return ((ctrl & 0x70) ? false : true);
 }
 
 
@@ -267,10 +312,10 @@ bool SPI_MCP2515::endPacket()
 uint8_t SPI_MCP2515::parsePacket()
 {
 	uint8_t n;
-	uint8_t intf = readRegister(REG_CANINTF);
-	if(intf & FLAG_RXnIF(0))
+	uint8_t status = rxStatus();
+	if(status & FLAG_RXSTATUS_RXB(0))
 		n = 0;
-	else if(intf & FLAG_RXnIF(1))
+	else if(status & FLAG_RXSTATUS_RXB(1))
 		n = 1;
 	else
 	{
@@ -278,39 +323,49 @@ uint8_t SPI_MCP2515::parsePacket()
 		
 		return 0;
 	}
+	_rx.filter = status & MASK_RXSTATUS_FILTER;
+	
+	// Команда READ RX BUFFER читает SIDH, SIDL, EID8, EID0, DLC и данные за одно
+	// выставление CS, а по его снятию чип сам сбрасывает флаг RXnIF.
+	// Буфер читается целиком одним списком сегментов: лишние байты после DLC дешевле второй транзакции.
+	uint8_t header[5 + sizeof(_rx.data)] = {};
+	uint8_t spi_data[] = {(uint8_t)CMD_READ_RX_BUFFER(n)};
+	SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(spi_data, sizeof(spi_data)), SPIManagerInterface::Rx(header, sizeof(header)) };
+	if(DeviceTransfer<manager_t>(segments) == false)
+	{
+		// Шина занята: буфер не прочитан и флаг RXnIF не снят, пакет заберём в следующий раз.
+		_rx.id = NO_CAN_ID;
+		
+		return 0;
+	}
 	
-	_rx.extended = (readRegister(REG_RXBnSIDL(n)) & FLAG_IDE) ? true : false;
+	_rx.extended = (header[1] & FLAG_IDE) ? true : false;
 	
-	uint32_t idA = ((readRegister(REG_RXBnSIDH(n)) << 3) & 0x07f8) | ((readRegister(REG_RXBnSIDL(n)) >> 5) & 0x07);
+	uint32_t idA = ((header[0] << 3) & 0x07f8) | ((header[1] >> 5) & 0x07);
 	if(_rx.extended == true)
 	{
-		uint32_t idB = (((uint32_t)(readRegister(REG_RXBnSIDL(n)) & 0x03) << 16) & 0x30000) | ((readRegister(REG_RXBnEID8(n)) << 8) & 0xff00) | readRegister(REG_RXBnEID0(n));
+		uint32_t idB = (((uint32_t)(header[1] & 0x03) << 16) & 0x30000) | ((header[2] << 8) & 0xff00) | header[3];
 		
 		_rx.id = (idA << 18) | idB;
-		_rx.rtr = (readRegister(REG_RXBnDLC(n)) & FLAG_RTR) ? true : false;
+		_rx.rtr = (header[4] & FLAG_RTR) ? true : false;
 	}
 	else
 	{
 		_rx.id = idA;
-		_rx.rtr = (readRegister(REG_RXBnSIDL(n)) & FLAG_SRR) ? true : false;
+		_rx.rtr = (header[1] & FLAG_SRR) ? true : false;
 	}
 	
-	_rx.dlc = readRegister(REG_RXBnDLC(n)) & 0x0f;
+	_rx.dlc = header[4] & 0x0f;
 	
 	if(_rx.rtr == true)
 		_rx.length = 0;
 	else
 	{
-		_rx.length = _rx.dlc;
+		_rx.length = (_rx.dlc > sizeof(_rx.data)) ? sizeof(_rx.data) : _rx.dlc;
 		
-		for(uint8_t i = 0; i < _rx.length; ++i)
-		{
-			_rx.data[i] = readRegister(REG_RXBnD0(n) + i);
-		}
+		memcpy(_rx.data, &header[5], _rx.length);
 	}
 	
-	modifyRegister(REG_CANINTF, FLAG_RXnIF(n), 0x00);
-	
 	return _rx.dlc;
 }
 
@@ -322,6 +377,9 @@ bool SPI_MCP2515::filter(uint16_t id, uint16_t mask)
 {
 	id &= 0x7ff;
 	mask &= 0x7ff;
+	_filter_soft = false;
+	_filter_mode = FILTER_SINGLE;
+	_filter_single = {id, mask, false};
 	
 	if( writeReadRegister(REG_CANCTRL, 0x80) == false ) return false;
 	
@@ -346,7 +404,7 @@ bool SPI_MCP2515::filter(uint16_t id, uint16_t mask)
 		writeRegister(REG_RXFnEID0(n), 0);
 	}
 	
-	if( writeReadRegister(REG_CANCTRL, 0x00) == false ) return false;
+	if( writeReadRegister(REG_CANCTRL, _opmode) == false ) return false;
 	
 	return true;
 }
@@ -355,6 +413,9 @@ bool SPI_MCP2515::filterExtended(uint32_t id, uint32_t mask)
 {
 	id &= 0x1FFFFFFF;
 	mask &= 0x1FFFFFFF;
+	_filter_soft = false;
+	_filter_mode = FILTER_SINGLE;
+	_filter_single = {id, mask, true};
 	
 	if( writeReadRegister(REG_CANCTRL, 0x80) == false ) return false;
 	
@@ -379,7 +440,344 @@ bool SPI_MCP2515::filterExtended(uint32_t id, uint32_t mask)
 		writeRegister(REG_RXFnEID0(n), id & 0xff);
 	}
 	
-	if( writeReadRegister(REG_CANCTRL, 0x00) == false ) return false;
+	if( writeReadRegister(REG_CANCTRL, _opmode) == false ) return false;
+	
+	return true;
+}
+
+// Правило фильтрации в раскладке регистров RXFn/RXMn: SID в битах 28..18, EID в битах 17..0.
+struct filter_rule_t
+{
+	uint32_t id;
+	uint32_t mask;
+	bool extended;
+};
+
+// Кол-во идентификаторов, которые пропускает правило с данной маской.
+static uint64_t FilterAccepted(uint32_t mask, bool extended)
+{
+	uint8_t width = (extended == true) ? 29 : 11;
+	uint8_t bits = __builtin_popcount(mask & ((extended == true) ? MASK_ID_EXT : MASK_ID_STD));
+	
+	return (uint64_t)1 << (width - bits);
+}
+
+// Кол-во различных фильтров, нужных записям select при общей маске mask. Первые out_max из них кладёт в out.
+static uint8_t FilterDistinct(const filter_rule_t *entries, uint8_t count, uint16_t select, uint32_t mask, filter_rule_t *out, uint8_t out_max)
+{
+	uint8_t result = 0;
+	for(uint8_t i = 0; i < count; ++i)
+	{
+		if((select & (1 << i)) == 0) continue;
+		
+		bool unique = true;
+		for(uint8_t j = 0; j < i; ++j)
+		{
+			if((select & (1 << j)) == 0) continue;
+			if(entries[j].extended != entries[i].extended) continue;
+			if(((entries[j].id ^ entries[i].id) & mask) != 0) continue;
+			
+			unique = false;
+			break;
+		}
+		if(unique == false) continue;
+		
+		if(result < out_max)
+		{
+			out[result].id = entries[i].id & mask;
+			out[result].mask = mask;
+			out[result].extended = entries[i].extended;
+		}
+		++result;
+	}
+	
+	return result;
+}
+
+// Подбирает общую маску для группы записей с capacity фильтрами: начиная с пересечения масок
+// записей, снимает по одному биту, сильнее всего сокращающему число различных фильтров.
+// Возвращает кол-во пропускаемых группой ID.
+static uint64_t FilterSolve(const filter_rule_t *entries, uint8_t count, uint16_t select, uint8_t capacity, uint32_t &mask, filter_rule_t *out)
+{
+	mask = MASK_ID_EXT;
+	if(select == 0) return 0;
+	
+	for(uint8_t i = 0; i < count; ++i)
+	{
+		if(select & (1 << i)) mask &= entries[i].mask;
+	}
+	
+	uint8_t distinct = FilterDistinct(entries, count, select, mask, out, 0);
+	while(distinct > capacity)
+	{
+		// Снимать имеет смысл только биты, по которым записи группы различаются.
+		uint32_t ones = 0, zeros = 0;
+		for(uint8_t i = 0; i < count; ++i)
+		{
+			if((select & (1 << i)) == 0) continue;
+			
+			ones |= entries[i].id;
+			zeros |= ~entries[i].id;
+		}
+		uint32_t varying = ones & zeros & mask;
+		
+		uint32_t best_bit = 0;
+		uint8_t best_distinct = 0xFF;
+		for(uint8_t b = 0; b < 29; ++b)
+		{
+			uint32_t bit = (uint32_t)1 << b;
+			if((varying & bit) == 0) continue;
+			
+			uint8_t result = FilterDistinct(entries, count, select, (mask & ~bit), out, 0);
+			if(result < best_distinct)
+			{
+				best_distinct = result;
+				best_bit = bit;
+			}
+		}
+		if(best_bit == 0) break;
+		
+		mask &= ~best_bit;
+		distinct = best_distinct;
+	}
+	
+	distinct = FilterDistinct(entries, count, select, mask, out, capacity);
+	uint64_t accepted = 0;
+	for(uint8_t i = 0; i < distinct; ++i)
+	{
+		accepted += FilterAccepted(mask, out[i].extended);
+	}
+	
+	return accepted;
+}
+
+bool SPI_MCP2515::filterTable(const filter_t *table, uint8_t count, filter_report_t *report)
+{
+	if(table == nullptr || count == 0 || count > FILTER_TABLE_MAX) return false;
+	
+	filter_rule_t entries[FILTER_TABLE_MAX];
+	uint16_t all = 0;
+	uint16_t extended = 0;
+	uint64_t wanted = 0;
+	for(uint8_t i = 0; i < count; ++i)
+	{
+		entries[i].extended = table[i].extended;
+		if(table[i].extended == true)
+		{
+			entries[i].mask = table[i].mask & MASK_ID_EXT;
+			entries[i].id = table[i].id & entries[i].mask;
+			extended |= (1 << i);
+		} else {
+			entries[i].mask = (table[i].mask & 0x7FF) << 18;
+			entries[i].id = ((table[i].id & 0x7FF) << 18) & entries[i].mask;
+		}
+		all |= (1 << i);
+		wanted += FilterAccepted(entries[i].mask, entries[i].extended);
+	}
+	
+	// RXB0 имеет маску RXM0 и 2 фильтра, RXB1 маску RXM1 и 4 фильтра. Стандартная запись обнуляет
+	// биты EID маски своей группы, поэтому начинаем с разнесения типов по буферам и затем
+	// переносим записи между группами по одной, пока это уменьшает кол-во пропускаемых ID.
+	filter_rule_t rules[2][4];
+	uint32_t masks[2];
+	uint16_t select = 0;
+	uint64_t best_accepted = UINT64_MAX;
+	const uint16_t starts[2] = {extended, (uint16_t)(all & ~extended)};
+	for(uint16_t candidate : starts)
+	{
+		bool improved = true;
+		while(improved == true)
+		{
+			improved = false;
+			for(int8_t i = -1; i < count; ++i)
+			{
+				uint16_t next = (i < 0) ? candidate : (candidate ^ (1 << i));
+				uint64_t accepted = FilterSolve(entries, count, next, 2, masks[0], rules[0]) + 
+									FilterSolve(entries, count, (all & ~next), 4, masks[1], rules[1]);
+				if(accepted < best_accepted)
+				{
+					best_accepted = accepted;
+					select = next;
+					candidate = next;
+					improved = (i >= 0);
+				}
+			}
+		}
+	}
+	
+	uint8_t rules_count[2];
+	FilterSolve(entries, count, select, 2, masks[0], rules[0]);
+	FilterSolve(entries, count, (all & ~select), 4, masks[1], rules[1]);
+	rules_count[0] = FilterDistinct(entries, count, select, masks[0], rules[0], 0);
+	rules_count[1] = FilterDistinct(entries, count, (all & ~select), masks[1], rules[1], 0);
+	
+	// Сравнение кол-ва ID не годится: пересекающиеся записи считаются в wanted дважды. Программная фильтрация
+	// нужна, если маска группы не покрывает маску хоть одной записи, т.е. запись расширена или слита с другой.
+	bool soft = false;
+	for(uint8_t i = 0; i < count; ++i)
+	{
+		uint32_t mask = masks[(select & (1 << i)) ? 0 : 1];
+		if((entries[i].mask & ~mask) != 0) soft = true;
+	}
+	
+	// Незанятые фильтры дублируют уже выставленные, пустая группа повторяет соседнюю.
+	for(uint8_t group = 0; group < 2; ++group)
+	{
+		if(rules_count[group] > 0) continue;
+		
+		rules[group][0] = rules[!group][0];
+		masks[group] = masks[!group];
+	}
+	
+	if( writeReadRegister(REG_CANCTRL, 0x80) == false ) return false;
+	
+	writeRegister(REG_RXBnCTRL(0), FLAG_BUKT);
+	writeRegister(REG_RXBnCTRL(1), 0x00);
+	
+	uint8_t n = 0;
+	for(uint8_t group = 0; group < 2; ++group)
+	{
+		writeIdRegisters(REG_RXMnSIDH(group), masks[group], false);
+		
+		uint8_t used = (rules_count[group] > 0) ? rules_count[group] : 1;
+		for(uint8_t i = 0; i < ((group == 0) ? 2 : 4); ++i, ++n)
+		{
+			const filter_rule_t &rule = rules[group][i % used];
+			writeIdRegisters(REG_RXFnSIDH(n), rule.id, rule.extended);
+		}
+	}
+	
+	if( writeReadRegister(REG_CANCTRL, _opmode) == false ) return false;
+	
+	_filter_mode = FILTER_TABLE;
+	_filter_table = table;
+	_filter_count = count;
+	_filter_soft = soft;
+	_filter_dropped = 0;
+	
+	if(report != nullptr)
+	{
+		report->filters = rules_count[0] + rules_count[1];
+		report->merged = count - report->filters;
+		report->wanted = (wanted > UINT32_MAX) ? UINT32_MAX : wanted;
+		report->accepted = (best_accepted > UINT32_MAX) ? UINT32_MAX : best_accepted;
+		report->false_positive = (best_accepted > wanted) ? report->accepted - report->wanted : 0;
+	}
+	
+	return true;
+}
+
+bool SPI_MCP2515::filterMatch(uint32_t id, bool extended) const
+{
+	for(uint8_t i = 0; i < _filter_count; ++i)
+	{
+		const filter_t &entry = _filter_table[i];
+		if(entry.extended != extended) continue;
+		
+		uint32_t mask = (extended == true) ? (entry.mask & 0x1FFFFFFF) : (entry.mask & 0x7FF);
+		if(((id ^ entry.id) & mask) == 0) return true;
+	}
+	
+	return false;
+}
+
+
+
+
+
+void SPI_MCP2515::checkErrors(uint32_t time)
+{
+	uint8_t counters[2];
+	uint8_t eflg;
+	if(readRegisters(REG_TEC, counters, sizeof(counters)) == false || readRegister(REG_EFLG, eflg) == false) return;
+	
+	// Рост счётчиков за интервал: TEC растёт на 8 за ошибку передачи, REC на 1 (или 8) за ошибку приёма.
+	_errors.tec_delta = (counters[0] > _errors.tec) ? (counters[0] - _errors.tec) : 0;
+	_errors.rec_delta = (counters[1] > _errors.rec) ? (counters[1] - _errors.rec) : 0;
+	_errors.tec = counters[0];
+	_errors.rec = counters[1];
+	_errors.eflg = eflg;
+	
+	if(eflg & (FLAG_EFLG_RXnOVR(0) | FLAG_EFLG_RXnOVR(1)))
+	{
+		_errors.overflow_count++;
+		modifyRegister(REG_EFLG, (FLAG_EFLG_RXnOVR(0) | FLAG_EFLG_RXnOVR(1)), 0x00);
+	}
+	
+	error_state_t state = ERROR_ACTIVE;
+	if(eflg & FLAG_EFLG_TXBO)
+		state = ERROR_BUS_OFF;
+	else if(eflg & (FLAG_EFLG_TXEP | FLAG_EFLG_RXEP))
+		state = ERROR_PASSIVE;
+	else if(eflg & FLAG_EFLG_EWARN)
+		state = ERROR_WARNING;
+	
+	if(state != _errors.state)
+	{
+		if(state == ERROR_PASSIVE) _errors.passive_count++;
+		if(state == ERROR_BUS_OFF)
+		{
+			_errors.bus_off_count++;
+			_recover_time = time + _recover_delay;
+		}
+		if(state == ERROR_ACTIVE) _recover_delay = RECOVER_DELAY_MIN;
+		
+		_errors.state = state;
+	}
+	
+	// Чип выходит из bus-off сам после 128 x 11 рецессивных бит. Если этого не случилось,
+	// перезапускаем его с удвоением паузы между попытками.
+	if(state == ERROR_BUS_OFF && (int32_t)(time - _recover_time) >= 0)
+	{
+		_errors.recovery_count++;
+		recover();
+		
+		if(_recover_delay < RECOVER_DELAY_MAX) _recover_delay *= 2;
+		_recover_time = time + _recover_delay;
+	}
+	
+	return;
+}
+
+bool SPI_MCP2515::recover()
+{
+	// Переход через режим конфигурации сбрасывает TEC/REC и состояние bus-off без потери настроек.
+	if(writeReadRegister(REG_CANCTRL, 0x80) == true && writeReadRegister(REG_CANCTRL, _opmode) == true) return true;
+	
+	// Чип не отвечает или потерял настройки: полная инициализация с восстановлением фильтров и режима.
+	// Пауза между попытками сохраняется, иначе удвоение в checkErrors() начиналось бы каждый раз заново.
+	error_stats_t errors = _errors;
+	uint32_t delay = _recover_delay;
+	uint8_t opmode = _opmode;
+	filter_mode_t mode = _filter_mode;
+	if(begin(_timing, _onReceive) == false) return false;
+	_errors = errors;
+	_recover_delay = delay;
+	_opmode = opmode;
+	
+	bool result = true;
+	switch(mode)
+	{
+		case FILTER_SINGLE:
+		{
+			filter_t single = _filter_single;
+			result = (single.extended == true) ? filterExtended(single.id, single.mask) : filter(single.id, single.mask);
+			break;
+		}
+		case FILTER_TABLE:
+		{
+			result = filterTable(_filter_table, _filter_count);
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	}
+	if(result == false) return false;
+	
+	// begin() оставляет чип в normal, фильтры возвращают в _opmode.
+	if(mode == FILTER_NONE && opmode != 0x00) return writeReadRegister(REG_CANCTRL, opmode);
 	
 	return true;
 }
@@ -390,15 +788,15 @@ bool SPI_MCP2515::filterExtended(uint32_t id, uint32_t mask)
 
 bool SPI_MCP2515::cmd_reset()
 {
-	DeviceActivate();
+	if(DeviceActivate<manager_t>() == false) return false;
 	uint8_t spi_data[] = {0xC0};
-	_spi_interface->TransmitData(spi_data, sizeof(spi_data));
-	DeviceDeactivate();
+	DeviceManager<manager_t>()->TransmitData(spi_data, sizeof(spi_data));
+	DeviceDeactivate<manager_t>();
 	
 	uint8_t stat;
 	uint16_t timeout = 1000;
 	do {
-		stat = readRegister(0x0E);
+		stat = readRegister(REG_CANSTAT);
 	} while (((stat & 0xE0) != 0x80) && --timeout);
 	
 	return timeout != 0;
@@ -406,12 +804,18 @@ bool SPI_MCP2515::cmd_reset()
 
 bool SPI_MCP2515::cmd_observe()
 {
-	return writeReadRegister(REG_CANCTRL, 0x60);
+	if(writeReadRegister(REG_CANCTRL, 0x60) == false) return false;
+	_opmode = 0x60;
+	
+	return true;
 }
 
 bool SPI_MCP2515::cmd_loopback()
 {
-	return writeReadRegister(REG_CANCTRL, 0x40);
+	if(writeReadRegister(REG_CANCTRL, 0x40) == false) return false;
+	_opmode = 0x40;
+	
+	return true;
 }
 
 bool SPI_MCP2515::cmd_sleep()
@@ -421,7 +825,10 @@ bool SPI_MCP2515::cmd_sleep()
 
 bool SPI_MCP2515::cmd_wakeup()
 {
-	return writeReadRegister(REG_CANCTRL, 0x00);
+	if(writeReadRegister(REG_CANCTRL, 0x00) == false) return false;
+	_opmode = 0x00;
+	
+	return true;
 }
 
 
@@ -430,31 +837,87 @@ bool SPI_MCP2515::cmd_wakeup()
 
 uint8_t SPI_MCP2515::readRegister(uint8_t address)
 {
-	DeviceActivate();
+	uint8_t result = 0x00;
+	readRegister(address, result);
+	
+	return result;
+}
+
+bool SPI_MCP2515::readRegister(uint8_t address, uint8_t &value)
+{
 	uint8_t spi_data[] = {0x03, address};
-	_spi_interface->TransmitData(spi_data, sizeof(spi_data));
-	_spi_interface->ReceiveData(spi_data, 1);
-	DeviceDeactivate();
+	uint8_t result[1] = {};
+	SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(spi_data, sizeof(spi_data)), SPIManagerInterface::Rx(result, sizeof(result)) };
+	if(DeviceTransfer<manager_t>(segments) == false) return false;
 	
-	return spi_data[0];
+	value = result[0];
+	
+	return true;
+}
+
+uint8_t SPI_MCP2515::readStatus()
+{
+	uint8_t spi_data[] = {CMD_READ_STATUS};
+	uint8_t result[1] = {};
+	SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(spi_data, sizeof(spi_data)), SPIManagerInterface::Rx(result, sizeof(result)) };
+	if(DeviceTransfer<manager_t>(segments) == false) return 0x00;
+	
+	return result[0];
+}
+
+uint8_t SPI_MCP2515::rxStatus()
+{
+	uint8_t spi_data[] = {CMD_RX_STATUS};
+	uint8_t result[1] = {};
+	SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(spi_data, sizeof(spi_data)), SPIManagerInterface::Rx(result, sizeof(result)) };
+	if(DeviceTransfer<manager_t>(segments) == false) return 0x00;
+	
+	return result[0];
+}
+
+bool SPI_MCP2515::readRegisters(uint8_t address, uint8_t *data, uint8_t length)
+{
+	uint8_t spi_data[] = {0x03, address};
+	SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(spi_data, sizeof(spi_data)), SPIManagerInterface::Rx(data, length) };
+	if(DeviceTransfer<manager_t>(segments) == false) return false;
+	
+	return true;
 }
 
 void SPI_MCP2515::modifyRegister(uint8_t address, uint8_t mask, uint8_t value)
 {
-	DeviceActivate();
+	if(DeviceActivate<manager_t>() == false) return;
 	uint8_t spi_data[] = {0x05, address, mask, value};
-	_spi_interface->TransmitData(spi_data, sizeof(spi_data));
-	DeviceDeactivate();
+	DeviceManager<manager_t>()->TransmitData(spi_data, sizeof(spi_data));
+	DeviceDeactivate<manager_t>();
 	
 	return;
 }
 
 void SPI_MCP2515::writeRegister(uint8_t address, uint8_t value)
 {
-	DeviceActivate();
+	if(DeviceActivate<manager_t>() == false) return;
 	uint8_t spi_data[] = {0x02, address, value};
-	_spi_interface->TransmitData(spi_data, sizeof(spi_data));
-	DeviceDeactivate();
+	DeviceManager<manager_t>()->TransmitData(spi_data, sizeof(spi_data));
+	DeviceDeactivate<manager_t>();
+	
+	return;
+}
+
+void SPI_MCP2515::writeIdRegisters(uint8_t address, uint32_t id, bool extended)
+{
+	// Регистры SIDH, SIDL, EID8, EID0 идут подряд, пишем их одной командой WRITE.
+	if(DeviceActivate<manager_t>() == false) return;
+	uint8_t spi_data[] = 
+	{
+		0x02, address, 
+		(uint8_t)(id >> 21), 
+		(uint8_t)((((id >> 18) & 0x07) << 5) | ((extended == true) ? FLAG_EXIDE : 0x00) | ((id >> 16) & 0x03)), 
+		(uint8_t)((id >> 8) & 0xff), 
+		(uint8_t)(id & 0xff)
+	};
+	DeviceManager<manager_t>()->TransmitData(spi_data, sizeof(spi_data));
+	DeviceDeactivate<manager_t>();
 	
 	return;
 }
@@ -462,7 +925,9 @@ void SPI_MCP2515::writeRegister(uint8_t address, uint8_t value)
 bool SPI_MCP2515::writeReadRegister(uint8_t address, uint8_t value)
 {
 	writeRegister(address, value);
-	if(readRegister(address) != value) return false;
+	
+	uint8_t result;
+	if(readRegister(address, result) == false || result != value) return false;
 	
 	return true;
 }
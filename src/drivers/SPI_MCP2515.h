@@ -8,6 +8,24 @@
 #include <string.h>
 #include <SPIManager.h>
 #include <DrakePinD.hpp>
+#include "CANDispatcher.h"
+
+/*
+	SPI_MCP2515_MANAGER - тип менеджера шины, через который идут регистровые функции драйвера.
+	По умолчанию SPIManagerInterface, вызовы виртуальные. С final-менеджером (SPIStaticManager) передача
+	встраивается, см. SPIStaticManager.h. Драйвер собирается в своём .cpp, поэтому тип задаётся флагами сборки
+	для всего проекта, а заголовок с его объявлением - в SPI_MCP2515_MANAGER_INCLUDE, например:
+		-DSPI_MCP2515_MANAGER=BusManager_t -DSPI_MCP2515_MANAGER_INCLUDE=\"BusManager.h\"
+	Устройство должно быть добавлено именно в менеджер этого типа.
+*/
+
+#if defined(SPI_MCP2515_MANAGER_INCLUDE)
+	#include SPI_MCP2515_MANAGER_INCLUDE
+#endif
+
+#if !defined(SPI_MCP2515_MANAGER)
+	#define SPI_MCP2515_MANAGER SPIManagerInterface
+#endif
 
 class SPI_MCP2515 : public SPIDeviceInterface
 {
@@ -23,11 +41,136 @@ class SPI_MCP2515 : public SPIDeviceInterface
 		uint32_t id = NO_CAN_ID;	// Идентификатор пакета CAN
 		uint8_t dlc = 0;			// DLC ??
 		uint8_t length = 0;			// Длина пакета CAN
+		uint8_t filter = 0;			// Номер сработавшего фильтра RXFn (из RX STATUS)
 		uint8_t data[8] = {};		// Данные пакета CAN
 	};
 	
+	enum filter_mode_t : uint8_t { FILTER_NONE, FILTER_SINGLE, FILTER_TABLE };
+	
+	static constexpr uint32_t RECOVER_DELAY_MIN = 100;
+	static constexpr uint32_t RECOVER_DELAY_MAX = 10000;
+	
 	public:
 		
+		// Состояние контроллера по счётчикам ошибок.
+		enum error_state_t : uint8_t
+		{
+			ERROR_ACTIVE,				// TEC и REC < 96
+			ERROR_WARNING,				// TEC или REC >= 96
+			ERROR_PASSIVE,				// TEC или REC >= 128
+			ERROR_BUS_OFF,				// TEC >= 256, чип отключён от шины
+		};
+		
+		// Статистика ошибок шины, обновляется в Tick() раз в интервал errorMonitor().
+		struct error_stats_t
+		{
+			error_state_t state;		// Текущее состояние
+			uint8_t tec;				// Счётчик ошибок передачи TEC
+			uint8_t rec;				// Счётчик ошибок приёма REC
+			uint8_t eflg;				// Последнее значение регистра EFLG
+			uint8_t tec_delta;			// Рост TEC за последний интервал
+			uint8_t rec_delta;			// Рост REC за последний интервал
+			uint32_t passive_count;		// Кол-во переходов в error passive
+			uint32_t bus_off_count;		// Кол-во переходов в bus-off
+			uint32_t overflow_count;	// Кол-во интервалов с переполнением приёмных буферов
+			uint32_t recovery_count;	// Кол-во принудительных перезапусков из bus-off
+		};
+		
+		// Запись таблицы аппаратной фильтрации. Для стандартных ID используются младшие 11 бит id и mask.
+		struct filter_t
+		{
+			uint32_t id;				// Идентификатор
+			uint32_t mask;				// Маска значимых битов идентификатора
+			bool extended;				// Флаг exID
+		};
+		
+		// Итог раскладки таблицы по 2 маскам и 6 фильтрам чипа.
+		struct filter_report_t
+		{
+			uint8_t filters;			// Кол-во различных правил, записанных в фильтры
+			uint8_t merged;				// Кол-во записей таблицы, поглощённых объединением
+			uint32_t wanted;			// Кол-во ID, которые требуются по таблице
+			uint32_t accepted;			// Кол-во ID, которые пропустит чип (оценка сверху)
+			uint32_t false_positive;	// Кол-во лишних ID, отсеиваемых программно
+		};
+		
+		static constexpr uint8_t FILTER_TABLE_MAX = 16;
+		
+		// Параметры битового тайминга. Длительность бита: 1 (Sync) + prop_seg + phase_seg1 + phase_seg2 квантов.
+		struct bit_timing_t
+		{
+			uint8_t cnf[3];				// Значения регистров CNF1, CNF2, CNF3
+			uint8_t brp;				// Делитель: квант = 2 * (brp + 1) / clock
+			uint8_t prop_seg;			// PropSeg, 1..8 квантов
+			uint8_t phase_seg1;			// PS1, 1..8 квантов
+			uint8_t phase_seg2;			// PS2, 2..8 квантов
+			uint8_t sjw;				// SJW, 1..4 кванта
+			uint16_t sample_point;		// Точка выборки, в десятых долях процента
+			uint32_t baud_rate;			// Фактическая скорость шины
+			bool valid;					// Скорость достижима с отклонением не более 0.5%
+		};
+		
+		/// @brief Рассчитать битовый тайминг для любой пары частоты кварца и скорости шины.
+		/// Для констант считается на этапе компиляции: static constexpr auto t = SPI_MCP2515::bitTiming(20000000, 500000);
+		/// @param clock_frequency Частота кварца MCP2515, Гц
+		/// @param baud_rate Скорость шины, бит/с
+		/// @param sample_point Желаемая точка выборки, в десятых долях процента
+		/// @return Параметры тайминга, поле valid == false если скорость недостижима
+		static constexpr bit_timing_t bitTiming(uint32_t clock_frequency, uint32_t baud_rate, uint16_t sample_point = 875)
+		{
+			bit_timing_t result = {};
+			if(clock_frequency == 0 || baud_rate == 0) return result;
+			
+			uint64_t best_error = UINT64_MAX;
+			uint16_t best_distance = UINT16_MAX;
+			for(uint8_t brp = 0; brp < 64; ++brp)
+			{
+				// 4 кванта (PS2 = 1) вне спецификации, но так работала прежняя таблица для 8 МГц / 1 Мбит.
+				for(uint8_t tq = 25; tq >= 4; --tq)
+				{
+					uint64_t div = (uint64_t)2 * (brp + 1) * tq;
+					uint64_t rate = (uint64_t)baud_rate * div;
+					uint64_t error = (rate > clock_frequency) ? (rate - clock_frequency) : (clock_frequency - rate);
+					
+					uint8_t ps2 = tq - (uint8_t)((tq * sample_point + 500) / 1000);
+					if(ps2 < 2) ps2 = 2;
+					if(tq - 1 - ps2 > 16) ps2 = tq - 1 - 16;
+					if(ps2 > 8) ps2 = 8;
+					if(tq == 4) ps2 = 1;
+					uint8_t segs = tq - 1 - ps2;
+					if(segs < 2 || segs > 16 || segs < ps2) continue;
+					
+					uint8_t prop = segs / 2;
+					uint8_t ps1 = segs - prop;
+					uint16_t point = (uint16_t)((1 + segs) * 1000 / tq);
+					uint16_t distance = (point > sample_point) ? (point - sample_point) : (sample_point - point);
+					
+					// Сначала точность скорости, затем близость точки выборки; при равенстве остаётся больше квантов.
+					if(error > best_error || (error == best_error && distance >= best_distance)) continue;
+					
+					best_error = error;
+					best_distance = distance;
+					
+					uint8_t sjw = (ps2 < 4) ? ps2 : 4;
+					if(ps1 < sjw) sjw = ps1;
+					
+					result.brp = brp;
+					result.prop_seg = prop;
+					result.phase_seg1 = ps1;
+					result.phase_seg2 = ps2;
+					result.sjw = sjw;
+					result.sample_point = point;
+					result.baud_rate = (uint32_t)(clock_frequency / div);
+					result.cnf[0] = ((sjw - 1) << 6) | brp;
+					result.cnf[1] = 0x80 | ((ps1 - 1) << 3) | (prop - 1);
+					result.cnf[2] = (ps2 - 1);
+				}
+			}
+			result.valid = (best_error != UINT64_MAX && best_error * 200 <= clock_frequency);
+			
+			return result;
+		}
+		
 		SPI_MCP2515(const DrakePin::PinD_t &cs_pin, const DrakePin::PinD_t &int_pin, uint32_t spi_prescaler) : 
 			SPIDeviceInterface(cs_pin, spi_prescaler), 
 			_int_pin(int_pin, DrakePin::Input, DrakePin::HiZ), 
@@ -36,11 +179,17 @@ class SPI_MCP2515 : public SPIDeviceInterface
 		{}
 		
 		bool begin(uint32_t clock_frequency, uint32_t baud_rate, func_rx_t callback);
+		bool begin(const bit_timing_t &timing, func_rx_t callback);
 		void end();
 		
 		virtual void Init() override;
 		virtual void Tick(uint32_t &time) override;
 		
+		/// @brief После begin() прочитать CNF1..CNF3 и сравнить с записанными, ничего не пишет. До begin(), в режиме
+		/// конфигурации после сброса, записать в CNF1 два узора, прочитать обратно и вернуть прежнее значение.
+		/// Чип не в режиме конфигурации и без begin() - проверки нет (PROBE_NONE).
+		virtual probe_t DeviceProbe() override;
+		
 		bool beginPacket(uint16_t id, bool rtr = false);
 		bool beginExtendedPacket(uint32_t id, bool rtr = false);
 		uint8_t write(uint8_t byte){ return write(&byte, 1); }
@@ -54,6 +203,27 @@ class SPI_MCP2515 : public SPIDeviceInterface
 		bool filterExtended(uint32_t id) { return filterExtended(id, 0x1fffffff); }
 		bool filterExtended(uint32_t id, uint32_t mask);
 		
+		/// @brief Раскладывает таблицу фильтров по аппаратным маскам и фильтрам, объединяя записи при нехватке.
+		/// @param table Таблица фильтров, должна существовать всё время работы (по ней идёт программная фильтрация)
+		/// @param count Кол-во записей, не более FILTER_TABLE_MAX
+		/// @param report Куда положить итог раскладки, может быть nullptr
+		/// @return true в случае успеха
+		bool filterTable(const filter_t *table, uint8_t count, filter_report_t *report = nullptr);
+		
+		/// @brief Кол-во пакетов, пропущенных чипом, но отброшенных программной фильтрацией
+		uint32_t filterDropped() const { return _filter_dropped; }
+		
+		/// @brief Передавать принятые пакеты диспетчеру по ID. Пакеты, которые он не обработал, уходят в callback из begin()
+		/// @param dispatcher Диспетчер, может быть nullptr
+		void setDispatcher(CANDispatcherInterface *dispatcher) { _dispatcher = dispatcher; }
+		
+		/// @brief Задать интервал опроса счётчиков ошибок
+		/// @param interval Интервал в мс, 0 отключает контроль ошибок и автоматическое восстановление
+		void errorMonitor(uint16_t interval) { _error_interval = interval; }
+		
+		/// @brief Статистика ошибок шины
+		const error_stats_t &errors() const { return _errors; }
+		
 		bool cmd_reset();
 		bool cmd_observe();
 		bool cmd_loopback();
@@ -62,22 +232,40 @@ class SPI_MCP2515 : public SPIDeviceInterface
 		
 	private:
 		
+		using manager_t = SPI_MCP2515_MANAGER;
+		
+		// Чтения возвращают false (статусы - 0x00, т.е. ни флагов, ни пакетов), если шина занята.
 		uint8_t readRegister(uint8_t address);
+		bool readRegister(uint8_t address, uint8_t &value);
+		bool readRegisters(uint8_t address, uint8_t *data, uint8_t length);
+		uint8_t readStatus();
+		uint8_t rxStatus();
 		void modifyRegister(uint8_t address, uint8_t mask, uint8_t value);
 		void writeRegister(uint8_t address, uint8_t value);
 		bool writeReadRegister(uint8_t address, uint8_t value);
+		void writeIdRegisters(uint8_t address, uint32_t id, bool extended);
+		bool filterMatch(uint32_t id, bool extended) const;
+		void checkErrors(uint32_t time);
+		bool recover();
 		
 		DrakePinD _int_pin;
 		packet_t _rx;
 		packet_t _tx;
 		func_rx_t _onReceive;
+		CANDispatcherInterface *_dispatcher = nullptr;
+		bit_timing_t _timing = {};
 		
+		error_stats_t _errors = {};
+		uint16_t _error_interval = 100;
+		uint32_t _error_last = 0;
+		uint32_t _recover_time = 0;
+		uint32_t _recover_delay = RECOVER_DELAY_MIN;
+		uint8_t _opmode = 0x00;				// Рабочий режим CANCTRL (normal, loopback, listen-only), восстанавливается в recover()
 		
-		struct cnf_f
-		{
-			uint32_t clockFrequency;
-			uint32_t baudRate;
-			uint8_t cnf[3];
-		};
-		static const cnf_f _cnf_map[26];
+		filter_mode_t _filter_mode = FILTER_NONE;
+		filter_t _filter_single = {};
+		const filter_t *_filter_table = nullptr;
+		uint8_t _filter_count = 0;
+		bool _filter_soft = false;
+		uint32_t _filter_dropped = 0;
 };
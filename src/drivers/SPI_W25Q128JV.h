@@ -1,7 +1,9 @@
 #pragma once
 #include <inttypes.h>
+#include <string.h>
 #include <SPIManager.h>
 #include <DrakePinD.hpp>
+#include "BusyWait.h"
 
 /*
 	Класс работы с SPI NOR памятью.
@@ -45,6 +47,7 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 	static constexpr uint8_t CMD_POWER_DOWN =				0xB9;
 	static constexpr uint8_t CMD_ENABLE_RESET =				0x66;
 	static constexpr uint8_t CMD_RESET_DEVICE =				0x99;
+	static constexpr uint8_t CMD_MODE_BIT_RESET =			0xFF;
 	
 	public:
 
@@ -62,21 +65,34 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 		
 		SPI_W25Q128JV(const DrakePin::PinD_t &cs_pin, uint32_t spi_prescaler) : SPIDeviceInterface(cs_pin, spi_prescaler)
 		{
-
+			// Времена операций, мкс: типовое и максимальное.
+			_busy.SetTiming(BusyWait::OP_PROGRAM, 400, 3000);
+			_busy.SetTiming(BusyWait::OP_ERASE_SECTOR, 45000, 400000);
+			_busy.SetTiming(BusyWait::OP_ERASE_BLOCK32, 120000, 1600000);
+			_busy.SetTiming(BusyWait::OP_ERASE_BLOCK64, 150000, 2000000);
+			_busy.SetTiming(BusyWait::OP_ERASE_CHIP, 40000000, 200000000);
 		}
 		
 		virtual void Init() override
 		{
-			DeviceActivate();
+			// Если чип оставлен в режиме непрерывного чтения (загрузчиком или XIP), команды сброса он не примет.
+			// 0xFF на 16 тактов выводит его из режима и для 2x, и для 4x I/O; в обычном режиме это пустая команда.
+			uint8_t mode_reset[2] = {CMD_MODE_BIT_RESET, CMD_MODE_BIT_RESET};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(mode_reset, sizeof(mode_reset)) };
+			_Transfer(segments);
+			
+			if(_Activate() == false) return;
 			SendCmd1(CMD_ENABLE_RESET);
 			DeviceDeactivate();
 			
-			DeviceActivate();
+			if(_Activate() == false) return;
 			SendCmd1(CMD_RESET_DEVICE);
 			DeviceDeactivate();
 			
 			WaitReady();
 			
+			ReadDevID(_probe_id);
+			
 			return;
 		}
 		
@@ -85,33 +101,140 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 			return;
 		}
 		
+		/// @brief Ожидание записи и стирания: источник времени, времена операций, статистика
+		BusyWait &Busy()
+		{
+			return _busy;
+		}
+		
+		/// @brief Сравнить JEDEC ID с прочитанным в Init()
+		virtual probe_t DeviceProbe() override
+		{
+			if(_probe_id[0] == 0x00 || _probe_id[0] == 0xFF) return PROBE_FAIL;
+			
+			uint8_t id[3];
+			if(ReadDevID(id) == false) return PROBE_FAIL;
+			
+			return (memcmp(id, _probe_id, sizeof(id)) == 0) ? PROBE_OK : PROBE_FAIL;
+		}
+		
 		
 		/// @brief Прочитать байты
 		/// @param address Адрес первого байта
 		/// @param length Кол-во читаемых байт
 		/// @param data Массив куда положить прочитанные данные
-		void ReadBytes(uint32_t address, uint8_t *data, uint32_t length)
+		/// @return false если чип не освободился или шина занята, данные при этом не прочитаны
+		bool ReadBytes(uint32_t address, uint8_t *data, uint32_t length)
 		{
-			if(address + length > NOR_MEM_SIZE) return;
-			if(WaitReady() == false) return;
+			if(address + length > NOR_MEM_SIZE) return false;
+			if(WaitReady() == false) return false;
 
-			DeviceActivate();
-			SendCmd4(CMD_READ_DATA, address);
-			_spi_interface->ReceiveData(data, length);
-			DeviceDeactivate();
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_READ_DATA, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, length) };
+			if(_Transfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 	
 		/// @brief Прочитать с указанной страницы указанное кол-во байт
 		/// @param page Адрес страницы
 		/// @param data Массив куда положить прочитанные данные
 		/// @param length Кол-во читаемых байт
-		void ReadPage(uint32_t page, uint8_t *data, uint32_t length = NOR_PAGE_SIZE)
+		bool ReadPage(uint32_t page, uint8_t *data, uint32_t length = NOR_PAGE_SIZE)
 		{
-			if(page > NOR_MAX_PAGE) return;
+			if(page > NOR_MAX_PAGE) return false;
 
-			ReadBytes((page * NOR_PAGE_SIZE), data, length);
+			return ReadBytes((page * NOR_PAGE_SIZE), data, length);
+		}
+		
+		/// @brief Начать непрерывное чтение: команда отправляется один раз, дальше данные идут через ReadStreamNext()
+		/// без снятия CS. Шина остаётся захваченной до ReadStreamEnd(), поэтому это годится только для отдельной шины:
+		/// другие устройства до ReadStreamEnd() получают отказ, а под FreeRTOS из других задач ждут.
+		/// Любой другой вызов драйвера, обращающийся к чипу, сначала закрывает поток.
+		/// @param address Адрес первого байта
+		/// @return false если чип не освободился или шина занята
+		bool ReadStreamBegin(uint32_t address)
+		{
+			if(address >= NOR_MEM_SIZE) return false;
+			if(WaitReady() == false) return false;
+			if(_Activate() == false) return false;
+			
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_READ_DATA, address);
+			_spi_interface->TransmitData(cmd, sizeof(cmd));
+			_stream = true;
+			
+			return true;
+		}
+		
+		/// @brief Прочитать следующие байты непрерывного чтения. После конца памяти чип продолжает с адреса 0.
+		/// @param data Массив куда положить прочитанные данные
+		/// @param length Кол-во читаемых байт
+		/// @return false если поток не начат или уже закрыт
+		bool ReadStreamNext(uint8_t *data, uint32_t length)
+		{
+			if(_stream == false) return false;
+			
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Rx(data, length) };
+			_spi_interface->Transfer(segments, 1);
+			
+			return true;
+		}
+		
+		/// @brief Завершить непрерывное чтение и освободить шину
+		void ReadStreamEnd()
+		{
+			if(_stream == false) return;
+			
+			_stream = false;
+			DeviceDeactivate();
+			
+			return;
+		}
+		
+		/// @brief Начать сессию чтения для частых мелких чтений по произвольным адресам. Шина захватывается
+		/// и настраивается один раз, а ReadSessionBytes() не опрашивает статус: на чтение остаются только команда,
+		/// адрес и данные. Пока сессия открыта, другие устройства на шине получают отказ (под FreeRTOS задачи,
+		/// кроме открывшей сессию, ждут её конца), поэтому закрывайте её перед обращением к ним. Любой другой вызов драйвера,
+		/// обращающийся к чипу (чтение, запись, стирание, статус, ID, проверка связи), сначала закрывает сессию.
+		/// @return false если чип не освободился или шина занята
+		bool ReadSessionBegin()
+		{
+			if(WaitReady() == false) return false;
+			if(DeviceAcquire() == false) return false;
+			_session = true;
+			
+			return true;
+		}
+		
+		/// @brief Прочитать байты в сессии
+		/// @param address Адрес первого байта
+		/// @param data Массив куда положить прочитанные данные
+		/// @param length Кол-во читаемых байт
+		/// @return false если сессия не открыта или адрес за пределами памяти
+		bool ReadSessionBytes(uint32_t address, uint8_t *data, uint32_t length)
+		{
+			if(_session == false) return false;
+			if(address + length > NOR_MEM_SIZE) return false;
+			
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_READ_DATA, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, length) };
+			
+			DeviceSelect();
+			_spi_interface->Transfer(segments, 2);
+			DeviceDeselect();
+			
+			return true;
+		}
+		
+		void ReadSessionEnd()
+		{
+			if(_session == false) return;
+			
+			_session = false;
+			DeviceRelease();
 			
 			return;
 		}
@@ -126,11 +249,12 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 			if((address % NOR_PAGE_SIZE) + length > NOR_PAGE_SIZE) return;
 			if(WaitReady() == false) return;
 			
-			WriteEnable();
-			DeviceActivate();
-			SendCmd4(CMD_PAGE_PROGRAM, address);
-			_spi_interface->TransmitData(data, length);
-			DeviceDeactivate();
+			if(WriteEnable() == false) return;
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_PAGE_PROGRAM, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Tx(data, length) };
+			if(_Transfer(segments) == false) return;
+			_busy.Start(BusyWait::OP_PROGRAM);
 			
 			return;
 		}
@@ -156,10 +280,11 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 			if(sector > NOR_MAX_SECTOR) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_SECTOR_ERASE_4KB, (sector * NOR_SECTOR_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_SECTOR);
 			
 			return;
 		}
@@ -171,10 +296,11 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 			if(block > NOR_MAX_BLOCK32) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_BLOCK_ERASE_32KB, (block * NOR_BLOCK32_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_BLOCK32);
 			
 			return;
 		}
@@ -186,10 +312,11 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 			if(block > NOR_MAX_BLOCK64) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_BLOCK_ERASE_64KB, (block * NOR_BLOCK64_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_BLOCK64);
 			
 			return;
 		}
@@ -199,71 +326,80 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 		{
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd1(CMD_CHIP_ERASE_60);
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_CHIP);
 			
 			return;
 		}
 		
-		void WriteEnable()
+		/// @return false если шина занята
+		bool WriteEnable()
 		{
-			DeviceActivate();
+			if(_Activate() == false) return false;
 			SendCmd1(CMD_WRITE_ENABLE);
 			DeviceDeactivate();
 
-			return;
+			return true;
 		}
 		
-		bool WaitReady(uint32_t delay = 100000)
+		bool WaitReady()
 		{
-			while(delay--)
-			{
-				if((ReadStatus1() & 0x01) == 0)
-					return true;
-			}
+			ReadStreamEnd();
+			ReadSessionEnd();
 			
-			return false;
+			return _busy.Wait([this]() { return (ReadStatus1() & 0x01) != 0; });
 		}
 		
+		/// @brief Ждать готовности не более delay опросов статуса подряд, без учёта времени
+		bool WaitReady(uint32_t delay)
+		{
+			ReadStreamEnd();
+			ReadSessionEnd();
+			
+			return _busy.Poll([this]() { return (ReadStatus1() & 0x01) != 0; }, delay);
+		}
+		
+		/// @return Регистр статуса 1. Если шина занята - 0xFF, т.е. чип считается занятым.
 		uint8_t ReadStatus1()
 		{
-			uint8_t status;
+			uint8_t status = 0xFF;
 			
-			DeviceActivate();
-			SendCmd1(CMD_READ_STATUS_REGISTER_1);
-			_spi_interface->ReceiveData(&status, 1);
-			DeviceDeactivate();
+			uint8_t cmd[1] = {CMD_READ_STATUS_REGISTER_1};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(&status, 1) };
+			if(_Transfer(segments) == false) return 0xFF;
 			
 			return status;
 		}
 		
+		/// @return false если шина занята, data при этом обнулён
 		template<uint8_t N> 
-		void ReadDevID(uint8_t (&data)[N])
+		bool ReadDevID(uint8_t (&data)[N])
 		{
 			static_assert(N >= 3, "Buffer too small for DevID");
+			memset(data, 0x00, N);
 			
-			DeviceActivate();
-			SendCmd1(CMD_JEDEC_ID);
-			_spi_interface->ReceiveData(data, 3);
-			DeviceDeactivate();
+			uint8_t cmd[1] = {CMD_JEDEC_ID};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, 3) };
+			if(_Transfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 		
+		/// @return false если шина занята, data при этом обнулён
 		template<uint8_t N> 
-		void ReadUniqueID(uint8_t (&data)[N])
+		bool ReadUniqueID(uint8_t (&data)[N])
 		{
 			static_assert(N >= 8, "Buffer too small for UniqueID");
+			memset(data, 0x00, N);
 			
-			DeviceActivate();
 			uint8_t tx[5] = {CMD_READ_UNIQUE_ID, 0x00, 0x00, 0x00, 0x00};
-			_spi_interface->TransmitData(tx, sizeof(tx));
-			_spi_interface->ReceiveData(data, 8);
-			DeviceDeactivate();
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(tx, sizeof(tx)), SPIManagerInterface::Rx(data, 8) };
+			if(_Transfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 		
 		void SendCmd1(uint8_t cmd)
@@ -274,17 +410,45 @@ class SPI_W25Q128JV : public SPIDeviceInterface
 			_spi_interface->TransmitData(data, sizeof(data));
 		}
 		
-		void SendCmd4(uint8_t cmd, uint32_t address)
+		static void FillCmd4(uint8_t (&data)[4], uint8_t cmd, uint32_t address)
 		{
-			uint8_t data[4] = {0x00};
 			data[0] = cmd;
 			data[1] = (address >> 16) & 0xFF;
 			data[2] = (address >> 8) & 0xFF;
 			data[3] = address & 0xFF;
+		}
+		
+		void SendCmd4(uint8_t cmd, uint32_t address)
+		{
+			uint8_t data[4];
+			FillCmd4(data, cmd, address);
 			
 			_spi_interface->TransmitData(data, sizeof(data));
 		}
 
 	private:
-
+		
+		// Все обращения к чипу идут через _Activate() / _Transfer(): поток и сессия чтения держат шину этим же устройством,
+		// и повторный захват (мьютекс RTOS не рекурсивный) повис бы или не удался. Поэтому сначала они закрываются.
+		bool _Activate()
+		{
+			ReadStreamEnd();
+			ReadSessionEnd();
+			
+			return DeviceActivate();
+		}
+		
+		template<uint8_t N> 
+		bool _Transfer(const SPIManagerInterface::segment_t (&segments)[N])
+		{
+			ReadStreamEnd();
+			ReadSessionEnd();
+			
+			return DeviceTransfer(segments);
+		}
+		
+		BusyWait _busy;
+		bool _stream = false;
+		bool _session = false;
+		uint8_t _probe_id[3] = {};
 };
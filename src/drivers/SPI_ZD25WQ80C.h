@@ -1,11 +1,18 @@
 #pragma once
 #include <inttypes.h>
+#include <string.h>
 #include <SPIManager.h>
 #include <DrakePinD.hpp>
+#include "BusyWait.h"
 
 /*
 	Класс работы с SPI NOR памятью.
 	Чип: ZD25WQ80C https://jlcpcb.com/api/file/downloadByFileSystemAccessId/8602999671405367296
+	
+	Времена стирания в конструкторе - заглушки, не сверенные с таблицей tSE / tBE / tCE даташита:
+	типовое 10 мс для всех стираний, максимумы взяты у ZD25Q80B. Заниженное типовое время стоит лишних
+	опросов статуса, а не ошибок, но статистика Busy() по стираниям считается от него. Заменить на значения
+	из даташита, когда они будут проверены.
 */
 
 class SPI_ZD25WQ80C : public SPIDeviceInterface
@@ -60,21 +67,35 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 		
 		SPI_ZD25WQ80C(const DrakePin::PinD_t &cs_pin, uint32_t spi_prescaler) : SPIDeviceInterface(cs_pin, spi_prescaler)
 		{
-
+			// Времена операций, мкс: типовое и максимальное. Стирания - заглушки, см. описание класса.
+			_busy.SetTiming(BusyWait::OP_PROGRAM, 500, 3000);
+			_busy.SetTiming(BusyWait::OP_ERASE_PAGE, 10000, 100000);
+			_busy.SetTiming(BusyWait::OP_ERASE_SECTOR, 10000, 300000);
+			_busy.SetTiming(BusyWait::OP_ERASE_BLOCK32, 10000, 1000000);
+			_busy.SetTiming(BusyWait::OP_ERASE_BLOCK64, 10000, 2000000);
+			_busy.SetTiming(BusyWait::OP_ERASE_CHIP, 10000, 10000000);
 		}
 		
 		virtual void Init() override
 		{
-			DeviceActivate();
+			// Если чип оставлен в режиме непрерывного чтения (загрузчиком или XIP), команды сброса он не примет.
+			// 0xFF на 16 тактов выводит его из режима и для 2x, и для 4x I/O; в обычном режиме это пустая команда.
+			uint8_t mode_reset[2] = {CMD_CONTINUOUS_READ_MODE_RESET, CMD_CONTINUOUS_READ_MODE_RESET};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(mode_reset, sizeof(mode_reset)) };
+			_Transfer(segments);
+			
+			if(_Activate() == false) return;
 			SendCmd1(CMD_RESET_ENABLE);
 			DeviceDeactivate();
 			
-			DeviceActivate();
+			if(_Activate() == false) return;
 			SendCmd1(CMD_RESET);
 			DeviceDeactivate();
 			
 			WaitReady();
 			
+			ReadDevID(_probe_id);
+			
 			return;
 		}
 		
@@ -83,33 +104,140 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			return;
 		}
 		
+		/// @brief Ожидание записи и стирания: источник времени, времена операций, статистика
+		BusyWait &Busy()
+		{
+			return _busy;
+		}
+		
+		/// @brief Сравнить JEDEC ID с прочитанным в Init()
+		virtual probe_t DeviceProbe() override
+		{
+			if(_probe_id[0] == 0x00 || _probe_id[0] == 0xFF) return PROBE_FAIL;
+			
+			uint8_t id[3];
+			if(ReadDevID(id) == false) return PROBE_FAIL;
+			
+			return (memcmp(id, _probe_id, sizeof(id)) == 0) ? PROBE_OK : PROBE_FAIL;
+		}
+		
 		
 		/// @brief Прочитать байты
 		/// @param address Адрес первого байта
 		/// @param length Кол-во читаемых байт
 		/// @param data Массив куда положить прочитанные данные
-		void ReadBytes(uint32_t address, uint8_t *data, uint32_t length)
+		/// @return false если чип не освободился или шина занята, данные при этом не прочитаны
+		bool ReadBytes(uint32_t address, uint8_t *data, uint32_t length)
 		{
-			if(address + length > NOR_MEM_SIZE) return;
-			if(WaitReady() == false) return;
+			if(address + length > NOR_MEM_SIZE) return false;
+			if(WaitReady() == false) return false;
 
-			DeviceActivate();
-			SendCmd4(CMD_READ_DATA_BYTES, address);
-			_spi_interface->ReceiveData(data, length);
-			DeviceDeactivate();
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_READ_DATA_BYTES, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, length) };
+			if(_Transfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 	
 		/// @brief Прочитать с указанной страницы указанное кол-во байт
 		/// @param page Адрес страницы
 		/// @param data Массив куда положить прочитанные данные
 		/// @param length Кол-во читаемых байт
-		void ReadPage(uint32_t page, uint8_t *data, uint32_t length = NOR_PAGE_SIZE)
+		bool ReadPage(uint32_t page, uint8_t *data, uint32_t length = NOR_PAGE_SIZE)
 		{
-			if(page > NOR_MAX_PAGE) return;
+			if(page > NOR_MAX_PAGE) return false;
 			
-			ReadBytes((page * NOR_PAGE_SIZE), data, length);
+			return ReadBytes((page * NOR_PAGE_SIZE), data, length);
+		}
+		
+		/// @brief Начать непрерывное чтение: команда отправляется один раз, дальше данные идут через ReadStreamNext()
+		/// без снятия CS. Шина остаётся захваченной до ReadStreamEnd(), поэтому это годится только для отдельной шины:
+		/// другие устройства до ReadStreamEnd() получают отказ, а под FreeRTOS из других задач ждут.
+		/// Любой другой вызов драйвера, обращающийся к чипу, сначала закрывает поток.
+		/// @param address Адрес первого байта
+		/// @return false если чип не освободился или шина занята
+		bool ReadStreamBegin(uint32_t address)
+		{
+			if(address >= NOR_MEM_SIZE) return false;
+			if(WaitReady() == false) return false;
+			if(_Activate() == false) return false;
+			
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_READ_DATA_BYTES, address);
+			_spi_interface->TransmitData(cmd, sizeof(cmd));
+			_stream = true;
+			
+			return true;
+		}
+		
+		/// @brief Прочитать следующие байты непрерывного чтения. После конца памяти чип продолжает с адреса 0.
+		/// @param data Массив куда положить прочитанные данные
+		/// @param length Кол-во читаемых байт
+		/// @return false если поток не начат или уже закрыт
+		bool ReadStreamNext(uint8_t *data, uint32_t length)
+		{
+			if(_stream == false) return false;
+			
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Rx(data, length) };
+			_spi_interface->Transfer(segments, 1);
+			
+			return true;
+		}
+		
+		/// @brief Завершить непрерывное чтение и освободить шину
+		void ReadStreamEnd()
+		{
+			if(_stream == false) return;
+			
+			_stream = false;
+			DeviceDeactivate();
+			
+			return;
+		}
+		
+		/// @brief Начать сессию чтения для частых мелких чтений по произвольным адресам. Шина захватывается
+		/// и настраивается один раз, а ReadSessionBytes() не опрашивает статус: на чтение остаются только команда,
+		/// адрес и данные. Пока сессия открыта, другие устройства на шине получают отказ (под FreeRTOS задачи,
+		/// кроме открывшей сессию, ждут её конца), поэтому закрывайте её перед обращением к ним. Любой другой вызов драйвера,
+		/// обращающийся к чипу (чтение, запись, стирание, статус, ID, проверка связи), сначала закрывает сессию.
+		/// @return false если чип не освободился или шина занята
+		bool ReadSessionBegin()
+		{
+			if(WaitReady() == false) return false;
+			if(DeviceAcquire() == false) return false;
+			_session = true;
+			
+			return true;
+		}
+		
+		/// @brief Прочитать байты в сессии
+		/// @param address Адрес первого байта
+		/// @param data Массив куда положить прочитанные данные
+		/// @param length Кол-во читаемых байт
+		/// @return false если сессия не открыта или адрес за пределами памяти
+		bool ReadSessionBytes(uint32_t address, uint8_t *data, uint32_t length)
+		{
+			if(_session == false) return false;
+			if(address + length > NOR_MEM_SIZE) return false;
+			
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_READ_DATA_BYTES, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, length) };
+			
+			DeviceSelect();
+			_spi_interface->Transfer(segments, 2);
+			DeviceDeselect();
+			
+			return true;
+		}
+		
+		void ReadSessionEnd()
+		{
+			if(_session == false) return;
+			
+			_session = false;
+			DeviceRelease();
 			
 			return;
 		}
@@ -124,11 +252,12 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			if((address % NOR_PAGE_SIZE) + length > NOR_PAGE_SIZE) return;
 			if(WaitReady() == false) return;
 			
-			WriteEnable();
-			DeviceActivate();
-			SendCmd4(CMD_PAGE_PROGRAM, address);
-			_spi_interface->TransmitData(data, length);
-			DeviceDeactivate();
+			if(WriteEnable() == false) return;
+			uint8_t cmd[4];
+			FillCmd4(cmd, CMD_PAGE_PROGRAM, address);
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Tx(data, length) };
+			if(_Transfer(segments) == false) return;
+			_busy.Start(BusyWait::OP_PROGRAM);
 			
 			return;
 		}
@@ -155,10 +284,11 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			if(page > NOR_MAX_PAGE) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_PAGE_ERASE, (page * NOR_PAGE_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_PAGE);
 			
 			return;
 		}
@@ -170,10 +300,11 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			if(sector > NOR_MAX_SECTOR) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_SECTOR_ERASE, (sector * NOR_SECTOR_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_SECTOR);
 			
 			return;
 		}
@@ -185,10 +316,11 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			if(block > NOR_MAX_BLOCK32) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_HALF_BLOCK_ERASE, (block * NOR_BLOCK32_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_BLOCK32);
 			
 			return;
 		}
@@ -200,10 +332,11 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			if(block > NOR_MAX_BLOCK64) return;
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd4(CMD_BLOCK_ERASE, (block * NOR_BLOCK64_SIZE));
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_BLOCK64);
 			
 			return;
 		}
@@ -213,71 +346,80 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 		{
 			if(WaitReady() == false) return;
 
-			WriteEnable();
-			DeviceActivate();
+			if(WriteEnable() == false) return;
+			if(_Activate() == false) return;
 			SendCmd1(CMD_CHIP_ERASE_60);
 			DeviceDeactivate();
+			_busy.Start(BusyWait::OP_ERASE_CHIP);
 			
 			return;
 		}
 		
-		void WriteEnable()
+		/// @return false если шина занята
+		bool WriteEnable()
 		{
-			DeviceActivate();
+			if(_Activate() == false) return false;
 			SendCmd1(CMD_WRITE_ENABLE);
 			DeviceDeactivate();
 
-			return;
+			return true;
 		}
 		
-		bool WaitReady(uint32_t delay = 100000)
+		bool WaitReady()
 		{
-			while(delay--)
-			{
-				if((ReadStatus1() & 0x01) == 0)
-					return true;
-			}
+			ReadStreamEnd();
+			ReadSessionEnd();
 			
-			return false;
+			return _busy.Wait([this]() { return (ReadStatus1() & 0x01) != 0; });
 		}
 		
+		/// @brief Ждать готовности не более delay опросов статуса подряд, без учёта времени
+		bool WaitReady(uint32_t delay)
+		{
+			ReadStreamEnd();
+			ReadSessionEnd();
+			
+			return _busy.Poll([this]() { return (ReadStatus1() & 0x01) != 0; }, delay);
+		}
+		
+		/// @return Регистр статуса 1. Если шина занята - 0xFF, т.е. чип считается занятым.
 		uint8_t ReadStatus1()
 		{
-			uint8_t status;
+			uint8_t status = 0xFF;
 			
-			DeviceActivate();
-			SendCmd1(CMD_READ_STATUS_REGISTER_1);
-			_spi_interface->ReceiveData(&status, 1);
-			DeviceDeactivate();
+			uint8_t cmd[1] = {CMD_READ_STATUS_REGISTER_1};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(&status, 1) };
+			if(_Transfer(segments) == false) return 0xFF;
 			
 			return status;
 		}
 		
+		/// @return false если шина занята, data при этом обнулён
 		template<uint8_t N> 
-		void ReadDevID(uint8_t (&data)[N])
+		bool ReadDevID(uint8_t (&data)[N])
 		{
 			static_assert(N >= 3, "Buffer too small for DevID");
+			memset(data, 0x00, N);
 			
-			DeviceActivate();
-			SendCmd1(CMD_READ_IDENTIFICATION);
-			_spi_interface->ReceiveData(data, 3);
-			DeviceDeactivate();
+			uint8_t cmd[1] = {CMD_READ_IDENTIFICATION};
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(cmd, sizeof(cmd)), SPIManagerInterface::Rx(data, 3) };
+			if(_Transfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 		
+		/// @return false если шина занята, data при этом обнулён
 		template<uint8_t N> 
-		void ReadUniqueID(uint8_t (&data)[N])
+		bool ReadUniqueID(uint8_t (&data)[N])
 		{
 			static_assert(N >= 16, "Buffer too small for UniqueID");
+			memset(data, 0x00, N);
 			
-			DeviceActivate();
 			uint8_t tx[5] = {CMD_READ_UNIQUE_ID, 0x00, 0x00, 0x00, 0x00};
-			_spi_interface->TransmitData(tx, sizeof(tx));
-			_spi_interface->ReceiveData(data, 16);
-			DeviceDeactivate();
+			SPIManagerInterface::segment_t segments[] = { SPIManagerInterface::Tx(tx, sizeof(tx)), SPIManagerInterface::Rx(data, 16) };
+			if(_Transfer(segments) == false) return false;
 			
-			return;
+			return true;
 		}
 		
 		void SendCmd1(uint8_t cmd)
@@ -288,17 +430,45 @@ class SPI_ZD25WQ80C : public SPIDeviceInterface
 			_spi_interface->TransmitData(data, sizeof(data));
 		}
 		
-		void SendCmd4(uint8_t cmd, uint32_t address)
+		static void FillCmd4(uint8_t (&data)[4], uint8_t cmd, uint32_t address)
 		{
-			uint8_t data[4] = {0x00};
 			data[0] = cmd;
 			data[1] = (address >> 16) & 0xFF;
 			data[2] = (address >> 8) & 0xFF;
 			data[3] = address & 0xFF;
+		}
+		
+		void SendCmd4(uint8_t cmd, uint32_t address)
+		{
+			uint8_t data[4];
+			FillCmd4(data, cmd, address);
 			
 			_spi_interface->TransmitData(data, sizeof(data));
 		}
 
 	private:
-
+		
+		// Все обращения к чипу идут через _Activate() / _Transfer(): поток и сессия чтения держат шину этим же устройством,
+		// и повторный захват (мьютекс RTOS не рекурсивный) повис бы или не удался. Поэтому сначала они закрываются.
+		bool _Activate()
+		{
+			ReadStreamEnd();
+			ReadSessionEnd();
+			
+			return DeviceActivate();
+		}
+		
+		template<uint8_t N> 
+		bool _Transfer(const SPIManagerInterface::segment_t (&segments)[N])
+		{
+			ReadStreamEnd();
+			ReadSessionEnd();
+			
+			return DeviceTransfer(segments);
+		}
+		
+		BusyWait _busy;
+		bool _stream = false;
+		bool _session = false;
+		uint8_t _probe_id[3] = {};
 };
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""
+Разбор журнала шины SPI (SPITrace::Dump()).
+
+	spi_trace.py dump.bin csv            > trace.csv
+	spi_trace.py dump.bin vcd --bitrate 8000000 > trace.vcd    (PulseView / sigrok-cli -I vcd, декодер SPI)
+	spi_trace.py dump.bin stats [--ops 8]
+
+Имена устройств: --names flash,can,leds (по порядку добавления в менеджер).
+
+stats выводит по устройствам кол-во транзакций, среднее и максимальное кол-во операций и байт
+на транзакцию, время на шине, транзакции длиннее --ops операций (например, чтение кадра
+по регистру за раз) и CONFIG, повторяющие уже выставленные на шине настройки.
+"""
+
+import argparse
+import struct
+import sys
+from collections import defaultdict
+
+HEADER = struct.Struct('<4sBBHII')
+RECORD = struct.Struct('<IBBH8s')
+
+OPS = {1: 'CONFIG', 2: 'TX', 3: 'RX', 4: 'TXRX', 5: 'END', 6: 'BUSY', 7: 'BATCH', 8: 'TXRX_TX'}
+DEVICE_NONE = 0xFF
+
+
+def load(path):
+	with open(path, 'rb') as f:
+		raw = f.read()
+
+	if len(raw) < HEADER.size:
+		sys.exit('file too short')
+	magic, version, record_size, count, total, clock_hz = HEADER.unpack_from(raw, 0)
+	if magic != b'SPTR':
+		sys.exit('not an SPITrace dump')
+	if version != 1 or record_size != RECORD.size:
+		sys.exit('unsupported dump version %d / record size %d' % (version, record_size))
+
+	records = []
+	offset = HEADER.size
+	for _ in range(count):
+		if offset + RECORD.size > len(raw):
+			break
+		time, device, op, length, data = RECORD.unpack_from(raw, offset)
+		records.append((time, device, OPS.get(op, str(op)), length, data[:min(length, 8)]))
+		offset += RECORD.size
+
+	return records, total, clock_hz
+
+
+def device_name(names, device):
+	if device == DEVICE_NONE:
+		return '-'
+	if device < len(names):
+		return names[device]
+	return 'dev%d' % device
+
+
+def unwrap(records):
+	# Счётчик времени 32-битный, при переполнении продолжаем отсчёт.
+	base = 0
+	last = None
+	for time, *rest in records:
+		if last is not None and time < last:
+			base += 1 << 32
+		last = time
+		yield (base + time, *rest)
+
+
+def cmd_csv(records, clock_hz, names, out):
+	out.write('time_s,device,op,length,data\n')
+	for time, device, op, length, data in unwrap(records):
+		out.write('%.9f,%s,%s,%d,%s\n' % (time / clock_hz, device_name(names, device), op, length, data.hex(' ')))
+
+
+def cmd_vcd(records, clock_hz, names, bitrate, out):
+	# Байты восстанавливаются только известные (первые 8 операции), и заканчиваются к времени записи.
+	timescale_ns = 1
+	bit_ns = max(2, round(1e9 / bitrate))
+	devices = sorted({r[1] for r in records if r[1] != DEVICE_NONE})
+	ids = {'sck': '!', 'mosi': '"', 'miso': '#'}
+	for i, device in enumerate(devices):
+		ids[device] = chr(ord('$') + i)
+
+	out.write('$timescale %dns $end\n$scope module spi $end\n' % timescale_ns)
+	out.write('$var wire 1 %s sck $end\n$var wire 1 %s mosi $end\n$var wire 1 %s miso $end\n' % (ids['sck'], ids['mosi'], ids['miso']))
+	for device in devices:
+		out.write('$var wire 1 %s cs_%s $end\n' % (ids[device], device_name(names, device)))
+	out.write('$upscope $end\n$enddefinitions $end\n#0\n0%s\n0%s\n0%s\n' % (ids['sck'], ids['mosi'], ids['miso']))
+	for device in devices:
+		out.write('1%s\n' % ids[device])
+
+	now = 0
+	selected = None
+	txrx_tx = b''
+
+	def emit(t, changes):
+		nonlocal now
+		if t > now:
+			out.write('#%d\n' % t)
+			now = t
+		out.write('\n'.join(changes) + '\n')
+
+	for time, device, op, length, data in unwrap(records):
+		t = round(time * 1e9 / clock_hz)
+		if op == 'CONFIG' and device in ids:
+			if selected is not None:
+				emit(t, ['1' + ids[selected]])
+			emit(t, ['0' + ids[device]])
+			selected = device
+		elif op == 'END':
+			if selected is not None:
+				emit(t, ['1' + ids[selected]])
+			selected = None
+		elif op == 'TXRX_TX':
+			# Переданные байты полного дуплекса, выводятся вместе со следующей TXRX.
+			txrx_tx = data
+		elif op in ('TX', 'RX', 'TXRX'):
+			start = max(now, t - len(data) * 8 * bit_ns)
+			lanes = []
+			if op in ('TX', 'TXRX'):
+				lanes.append((ids['mosi'], data if op == 'TX' else txrx_tx))
+			if op in ('RX', 'TXRX'):
+				lanes.append((ids['miso'], data))
+			txrx_tx = b''
+			for i in range(len(data)):
+				for bit in range(7, -1, -1):
+					changes = ['%d%s' % ((lane[i] >> bit) & 1, line) for line, lane in lanes if i < len(lane)]
+					emit(start, changes + ['0' + ids['sck']])
+					emit(start + bit_ns // 2, ['1' + ids['sck']])
+					start += bit_ns
+			emit(start, ['0' + ids['sck']])
+
+
+def cmd_stats(records, total, clock_hz, names, ops_limit, out):
+	stats = defaultdict(lambda: {'transactions': 0, 'ops': 0, 'bytes': 0, 'max_ops': 0, 'max_bytes': 0,
+		'busy_s': 0.0, 'long': 0, 'same_config': 0, 'busy': 0})
+	last_config = None
+	current = None
+
+	for time, device, op, length, data in unwrap(records):
+		s = stats[device]
+		if op == 'CONFIG':
+			# Настройки шины те же, что уже выставлены: перенастройка лишняя.
+			if last_config == data:
+				s['same_config'] += 1
+			last_config = data
+			current = {'device': device, 'start': time, 'ops': 0, 'bytes': 0}
+		elif op in ('TX', 'RX', 'TXRX') and current is not None:
+			current['ops'] += 1
+			current['bytes'] += length
+		elif op == 'END' and current is not None:
+			s = stats[current['device']]
+			s['transactions'] += 1
+			s['ops'] += current['ops']
+			s['bytes'] += current['bytes']
+			s['max_ops'] = max(s['max_ops'], current['ops'])
+			s['max_bytes'] = max(s['max_bytes'], current['bytes'])
+			s['busy_s'] += (time - current['start']) / clock_hz
+			if current['ops'] > ops_limit:
+				s['long'] += 1
+			current = None
+		elif op == 'BUSY':
+			s['busy'] += 1
+
+	if total > len(records):
+		out.write('%d records overwritten, only last %d available\n' % (total - len(records), len(records)))
+	if records:
+		span = (records[-1][0] - records[0][0]) / clock_hz if records[-1][0] >= records[0][0] else 0
+		out.write('span %.6f s\n' % span)
+
+	out.write('%-12s %8s %8s %8s %8s %8s %10s %6s %8s %5s\n' % ('device', 'trans', 'ops/tr', 'max_ops', 'B/tr', 'max_B', 'bus_s', '>ops', 'same_cfg', 'busy'))
+	for device in sorted(stats):
+		s = stats[device]
+		n = s['transactions']
+		out.write('%-12s %8d %8.1f %8d %8.1f %8d %10.6f %6d %8d %5d\n' % (device_name(names, device), n,
+			s['ops'] / n if n else 0, s['max_ops'], s['bytes'] / n if n else 0, s['max_bytes'],
+			s['busy_s'], s['long'], s['same_config'], s['busy']))
+
+
+def main():
+	parser = argparse.ArgumentParser(description='SPITrace dump converter')
+	parser.add_argument('dump')
+	parser.add_argument('format', choices=['csv', 'vcd', 'stats'])
+	parser.add_argument('--names', default='', help='device names in AddDevice() order, comma separated')
+	parser.add_argument('--bitrate', type=float, default=1e6, help='SPI clock for vcd, Hz')
+	parser.add_argument('--ops', type=int, default=4, help='stats: report transactions with more operations')
+	args = parser.parse_args()
+
+	records, total, clock_hz = load(args.dump)
+	names = [n for n in args.names.split(',') if n]
+
+	if args.format == 'csv':
+		cmd_csv(records, clock_hz, names, sys.stdout)
+	elif args.format == 'vcd':
+		cmd_vcd(records, clock_hz, names, args.bitrate, sys.stdout)
+	else:
+		cmd_stats(records, total, clock_hz, names, args.ops, sys.stdout)
+
+
+if __name__ == '__main__':
+	main()